@@ -0,0 +1,158 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "image.h"
+
+// Saving in the background. save_image_async queues an image for a small
+// pool of writer threads and returns at once; a worker converts it to
+// bytes, runs the encoder and frees it. The pool starts on first use and
+// is drained at exit, so queued images are never lost.
+
+// Most writer threads the pool will start.
+#define SAVE_THREADS_MAX 4
+
+struct save_job{
+    image im;
+    char *name;
+    int png;
+    int done;
+    int ok;
+    int detached;
+    struct save_job *next;
+};
+
+static pthread_mutex_t save_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t save_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t save_done = PTHREAD_COND_INITIALIZER;
+static save_job *save_head = 0, *save_tail = 0;
+static pthread_t save_threads[SAVE_THREADS_MAX];
+static int save_nthreads = 0;
+static int save_pending = 0;
+static int save_stopping = 0;
+static int save_started = 0;
+
+static void *save_worker(void *arg)
+{
+    pthread_mutex_lock(&save_lock);
+    while(1){
+        while(!save_head && !save_stopping) pthread_cond_wait(&save_ready, &save_lock);
+        if(!save_head) break;
+        save_job *job = save_head;
+        save_head = job->next;
+        if(!save_head) save_tail = 0;
+        pthread_mutex_unlock(&save_lock);
+
+        int ok = write_image_stb(job->im, job->name, job->png);
+        free_image(job->im);
+        free(job->name);
+
+        pthread_mutex_lock(&save_lock);
+        --save_pending;
+        if(job->detached){
+            free(job);
+        } else {
+            job->ok = ok;
+            job->done = 1;
+        }
+        pthread_cond_broadcast(&save_done);
+    }
+    pthread_mutex_unlock(&save_lock);
+    return 0;
+}
+
+// Finishes everything queued and stops the workers. Runs at exit.
+static void stop_save_pool()
+{
+    wait_all_saves();
+    pthread_mutex_lock(&save_lock);
+    save_stopping = 1;
+    pthread_cond_broadcast(&save_ready);
+    int n = save_nthreads;
+    save_nthreads = 0;
+    pthread_mutex_unlock(&save_lock);
+    int i;
+    for(i = 0; i < n; ++i) pthread_join(save_threads[i], 0);
+}
+
+// Starts the workers, called with save_lock held. Only ever tried once,
+// if no thread can be started saves just happen in the caller.
+static void start_save_pool()
+{
+    save_started = 1;
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int n = MIN(MAX((int)cores - 1, 1), SAVE_THREADS_MAX);
+    int i;
+    for(i = 0; i < n; ++i){
+        if(pthread_create(&save_threads[save_nthreads], 0, save_worker, 0) == 0) ++save_nthreads;
+    }
+    if(save_nthreads) atexit(stop_save_pool);
+}
+
+// Saves an image in the background as name.jpg, or name.png if png is set.
+// The image now belongs to the writer and is freed once it is written, the
+// caller must not touch or free it after this call. If no writer thread
+// can be started the image is saved before returning.
+// image im: image to save, ownership passes to the writer.
+// const char *name: file name without extension.
+// int png: 1 for png, 0 for jpg.
+// returns: handle for wait_save or detach_save.
+save_job *save_image_async(image im, const char *name, int png)
+{
+    save_job *job = calloc(1, sizeof(save_job));
+    job->im = im;
+    job->name = strdup(name);
+    job->png = png;
+
+    pthread_mutex_lock(&save_lock);
+    if(!save_started) start_save_pool();
+    if(!save_nthreads){
+        pthread_mutex_unlock(&save_lock);
+        job->ok = write_image_stb(im, name, png);
+        job->done = 1;
+        free_image(im);
+        free(job->name);
+        return job;
+    }
+    if(save_tail) save_tail->next = job;
+    else save_head = job;
+    save_tail = job;
+    ++save_pending;
+    pthread_cond_signal(&save_ready);
+    pthread_mutex_unlock(&save_lock);
+    return job;
+}
+
+// Blocks until a save finishes and releases its handle.
+// save_job *job: handle from save_image_async.
+// returns: 1 if the file was written, 0 if it failed.
+int wait_save(save_job *job)
+{
+    pthread_mutex_lock(&save_lock);
+    while(!job->done) pthread_cond_wait(&save_done, &save_lock);
+    pthread_mutex_unlock(&save_lock);
+    int ok = job->ok;
+    free(job);
+    return ok;
+}
+
+// Lets a save finish on its own. The handle is released and must not be
+// used again.
+void detach_save(save_job *job)
+{
+    pthread_mutex_lock(&save_lock);
+    int done = job->done;
+    job->detached = 1;
+    pthread_mutex_unlock(&save_lock);
+    if(done) free(job);
+}
+
+// Blocks until every queued save has been written.
+void wait_all_saves()
+{
+    pthread_mutex_lock(&save_lock);
+    while(save_pending) pthread_cond_wait(&save_done, &save_lock);
+    pthread_mutex_unlock(&save_lock);
+}
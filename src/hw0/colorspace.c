@@ -0,0 +1,356 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "image.h"
+
+// Colorspace conversions as a list of stages, each one
+//     per channel curve -> 3x3 matrix + bias -> per channel curve
+// Building a pipeline walks the graph of spaces and appends stages.
+// Neighboring stages with no curve between them are folded into a single
+// matrix as they're added, so rgb -> Lab -> adjust -> rgb ends up as a
+// handful of stages. apply_color_pipeline runs every stage over a block of
+// pixels while it's in cache, one pass over the image no matter how long
+// the chain is.
+//
+// Spaces and units:
+//   COLOR_RGB         sRGB encoded, [0, 1]
+//   COLOR_LINEAR_RGB  sRGB primaries, linear light, [0, 1]
+//   COLOR_XYZ         CIE XYZ, D65, Y = 1 for white
+//   COLOR_LAB         CIE L*a*b*, D65, L in [0, 100]
+//   COLOR_YCBCR       BT.601 full range on encoded RGB, Cb and Cr centered on .5
+//   COLOR_GRAY        luma, BT.601 weights on encoded RGB (same as
+//                     rgb_to_grayscale), one channel
+
+// Pixels converted per block.
+#define COLOR_BLOCK 256
+
+// D65 white point.
+#define WHITE_X 0.95047f
+#define WHITE_Y 1.0f
+#define WHITE_Z 1.08883f
+
+#define CURVE_LUT_SIZE 4096
+
+static float srgb_decode_lut[CURVE_LUT_SIZE + 1];
+static float srgb_encode_lut[CURVE_LUT_SIZE + 1];
+static int curves_ready = 0;
+
+static double srgb_decode(double x)
+{
+    return (x <= 0.04045) ? x/12.92 : pow((x + 0.055)/1.055, 2.4);
+}
+
+static double srgb_encode(double x)
+{
+    return (x <= 0.0031308) ? 12.92*x : 1.055*pow(x, 1/2.4) - 0.055;
+}
+
+static void make_curve_luts()
+{
+    int i;
+    for(i = 0; i <= CURVE_LUT_SIZE; ++i){
+        double x = (double)i/CURVE_LUT_SIZE;
+        srgb_decode_lut[i] = srgb_decode(x);
+        // Indexed by sqrt(x), the encode curve is steep near 0.
+        srgb_encode_lut[i] = srgb_encode(x*x);
+    }
+    curves_ready = 1;
+}
+
+static inline float curve_lookup(const float *lut, float x)
+{
+    x = MIN(MAX(x, 0), 1) * CURVE_LUT_SIZE;
+    int i = MIN((int)x, CURVE_LUT_SIZE - 1);
+    float f = x - i;
+    return lut[i] + (lut[i+1] - lut[i])*f;
+}
+
+static inline float color_cbrt(float x)
+{
+    float a = fabsf(x);
+    int i;
+    memcpy(&i, &a, sizeof(float));
+    i = i/3 + 709921077;
+    float y;
+    memcpy(&y, &i, sizeof(float));
+    y = (2*y + a/(y*y)) * (1.f/3);
+    y = (2*y + a/(y*y)) * (1.f/3);
+    y = (a == 0) ? 0 : y;
+    return (x < 0) ? -y : y;
+}
+
+// Applies a curve to n values in place.
+static void apply_curve(COLOR_CURVE c, float *v, int n)
+{
+    int i;
+    switch(c){
+        case CURVE_SRGB_DECODE:
+            for(i = 0; i < n; ++i) v[i] = curve_lookup(srgb_decode_lut, v[i]);
+            break;
+        case CURVE_SRGB_ENCODE:
+            for(i = 0; i < n; ++i) v[i] = curve_lookup(srgb_encode_lut, sqrtf(MAX(v[i], 0)));
+            break;
+        case CURVE_LAB_F:
+            #pragma omp simd
+            for(i = 0; i < n; ++i){
+                float t = v[i];
+                v[i] = (t > 216/24389.f) ? color_cbrt(t) : (24389/27.f*t + 16)/116;
+            }
+            break;
+        case CURVE_LAB_FINV:
+            #pragma omp simd
+            for(i = 0; i < n; ++i){
+                float t = v[i];
+                v[i] = (t > 6/29.f) ? t*t*t : (116*t - 16)*(27/24389.f);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+static color_stage matrix_stage(float m00, float m01, float m02,
+                                float m10, float m11, float m12,
+                                float m20, float m21, float m22)
+{
+    color_stage s = {0};
+    s.m[0][0] = m00; s.m[0][1] = m01; s.m[0][2] = m02;
+    s.m[1][0] = m10; s.m[1][1] = m11; s.m[1][2] = m12;
+    s.m[2][0] = m20; s.m[2][1] = m21; s.m[2][2] = m22;
+    return s;
+}
+
+static color_stage curve_stage(COLOR_CURVE pre, COLOR_CURVE post)
+{
+    color_stage s = matrix_stage(1, 0, 0, 0, 1, 0, 0, 0, 1);
+    s.pre = pre;
+    s.post = post;
+    return s;
+}
+
+// Appends a stage, folding it into the last one when no curve separates
+// them: (M2, b2) after (M1, b1) is (M2 M1, M2 b1 + b2).
+// returns: 1 on success, 0 if the pipeline is already full.
+static int push_stage(color_pipeline *p, color_stage s)
+{
+    if(p->n > 0 && p->stages[p->n - 1].post == CURVE_NONE && s.pre == CURVE_NONE){
+        color_stage *l = &p->stages[p->n - 1];
+        color_stage f = *l;
+        int i, j, k;
+        for(i = 0; i < 3; ++i){
+            f.bias[i] = s.bias[i];
+            for(j = 0; j < 3; ++j){
+                f.m[i][j] = 0;
+                for(k = 0; k < 3; ++k) f.m[i][j] += s.m[i][k]*l->m[k][j];
+            }
+            for(k = 0; k < 3; ++k) f.bias[i] += s.m[i][k]*l->bias[k];
+        }
+        f.post = s.post;
+        *l = f;
+        return 1;
+    }
+    if(p->n == COLOR_MAX_STAGES) return 0;
+    p->stages[p->n++] = s;
+    return 1;
+}
+
+// One edge of the conversion graph.
+// returns: 1 on success, 0 if the pipeline ran out of stages.
+static int push_edge(color_pipeline *p, COLORSPACE from, COLORSPACE to)
+{
+    color_stage s;
+    int ok = 1;
+    if(from == COLOR_RGB && to == COLOR_LINEAR_RGB){
+        ok &= push_stage(p, curve_stage(CURVE_SRGB_DECODE, CURVE_NONE));
+    } else if(from == COLOR_LINEAR_RGB && to == COLOR_RGB){
+        ok &= push_stage(p, curve_stage(CURVE_NONE, CURVE_SRGB_ENCODE));
+    } else if(from == COLOR_LINEAR_RGB && to == COLOR_XYZ){
+        ok &= push_stage(p, matrix_stage(0.4124564f, 0.3575761f, 0.1804375f,
+                                   0.2126729f, 0.7151522f, 0.0721750f,
+                                   0.0193339f, 0.1191920f, 0.9503041f));
+    } else if(from == COLOR_XYZ && to == COLOR_LINEAR_RGB){
+        ok &= push_stage(p, matrix_stage( 3.2404542f, -1.5371385f, -0.4985314f,
+                                   -0.9692660f,  1.8760108f,  0.0415560f,
+                                    0.0556434f, -0.2040259f,  1.0572252f));
+    } else if(from == COLOR_XYZ && to == COLOR_LAB){
+        s = matrix_stage(1/WHITE_X, 0, 0, 0, 1/WHITE_Y, 0, 0, 0, 1/WHITE_Z);
+        s.post = CURVE_LAB_F;
+        ok &= push_stage(p, s);
+        s = matrix_stage(  0, 116,    0,
+                         500, -500,   0,
+                           0, 200, -200);
+        s.bias[0] = -16;
+        ok &= push_stage(p, s);
+    } else if(from == COLOR_LAB && to == COLOR_XYZ){
+        s = matrix_stage(1/116.f,  1/500.f,        0,
+                         1/116.f,        0,        0,
+                         1/116.f,        0, -1/200.f);
+        s.bias[0] = s.bias[1] = s.bias[2] = 16/116.f;
+        s.post = CURVE_LAB_FINV;
+        ok &= push_stage(p, s);
+        ok &= push_stage(p, matrix_stage(WHITE_X, 0, 0, 0, WHITE_Y, 0, 0, 0, WHITE_Z));
+    } else if(from == COLOR_RGB && to == COLOR_YCBCR){
+        s = matrix_stage( 0.299f,     0.587f,     0.114f,
+                         -0.168736f, -0.331264f,  0.5f,
+                          0.5f,      -0.418688f, -0.081312f);
+        s.bias[1] = s.bias[2] = .5f;
+        ok &= push_stage(p, s);
+    } else if(from == COLOR_YCBCR && to == COLOR_RGB){
+        s = matrix_stage(1,  0,         1.402f,
+                         1, -0.344136f, -0.714136f,
+                         1,  1.772f,     0);
+        s.bias[0] = -.5f*1.402f;
+        s.bias[1] = .5f*(0.344136f + 0.714136f);
+        s.bias[2] = -.5f*1.772f;
+        ok &= push_stage(p, s);
+    } else if(from == COLOR_RGB && to == COLOR_GRAY){
+        // Every lane carries the luma so gray reads back as neutral RGB.
+        ok &= push_stage(p, matrix_stage(0.299f, 0.587f, 0.114f,
+                                   0.299f, 0.587f, 0.114f,
+                                   0.299f, 0.587f, 0.114f));
+    }
+    // COLOR_GRAY -> COLOR_RGB needs no stage, the lanes are already equal.
+    return ok;
+}
+
+// Position along RGB -> linear -> XYZ -> Lab, -1 for spaces off that line.
+static int chain_index(COLORSPACE c)
+{
+    switch(c){
+        case COLOR_RGB: return 0;
+        case COLOR_LINEAR_RGB: return 1;
+        case COLOR_XYZ: return 2;
+        case COLOR_LAB: return 3;
+        default: return -1;
+    }
+}
+
+static const COLORSPACE chain[] = {COLOR_RGB, COLOR_LINEAR_RGB, COLOR_XYZ, COLOR_LAB};
+
+// Appends the conversion from the pipeline's current space to another.
+// color_pipeline *p: pipeline to extend.
+// COLORSPACE to: space the pipeline should end in.
+// returns: 1 on success. 0 if the conversion needs more than
+//          COLOR_MAX_STAGES stages in total, the pipeline is left as it was.
+int color_pipeline_convert(color_pipeline *p, COLORSPACE to)
+{
+    COLORSPACE from = p->to;
+    if(from == to) return 1;
+    color_pipeline before = *p;
+    int ok = 1;
+    // YCbCr and gray hang off encoded RGB.
+    if(chain_index(from) < 0){
+        ok &= push_edge(p, from, COLOR_RGB);
+        from = COLOR_RGB;
+    }
+    int a = chain_index(from);
+    int b = chain_index(to) < 0 ? 0 : chain_index(to);
+    while(a < b){ ok &= push_edge(p, chain[a], chain[a+1]); ++a; }
+    while(a > b){ ok &= push_edge(p, chain[a], chain[a-1]); --a; }
+    if(chain_index(to) < 0) ok &= push_edge(p, COLOR_RGB, to);
+    if(!ok){
+        fprintf(stderr, "Color pipeline is full, can't add conversion\n");
+        *p = before;
+        return 0;
+    }
+    p->to = to;
+    return 1;
+}
+
+// Makes a pipeline that converts between two colorspaces.
+// COLORSPACE from: space of the input image.
+// COLORSPACE to: space of the output image.
+// returns: pipeline ready for apply_color_pipeline.
+color_pipeline make_color_pipeline(COLORSPACE from, COLORSPACE to)
+{
+    color_pipeline p;
+    memset(&p, 0, sizeof(p));
+    p.from = from;
+    p.to = from;
+    color_pipeline_convert(&p, to);
+    return p;
+}
+
+// Appends an affine adjustment in the pipeline's current space,
+// v' = m v + bias. Folds into the neighboring matrices when it can.
+// color_pipeline *p: pipeline to extend.
+// float m[3][3]: matrix to apply.
+// float bias[3]: offset to add after the matrix, 0 for none.
+// returns: 1 on success, 0 if the pipeline is full and was left as it was.
+int color_pipeline_affine(color_pipeline *p, float m[3][3], float bias[3])
+{
+    color_stage s = {0};
+    memcpy(s.m, m, sizeof(s.m));
+    if(bias) memcpy(s.bias, bias, sizeof(s.bias));
+    if(!push_stage(p, s)){
+        fprintf(stderr, "Color pipeline is full, can't add adjustment\n");
+        return 0;
+    }
+    return 1;
+}
+
+// Runs every stage of a pipeline over one block of pixels in place.
+static void run_stages(color_pipeline *p, float *x, float *y, float *z, int n)
+{
+    int s, i;
+    for(s = 0; s < p->n; ++s){
+        color_stage *st = &p->stages[s];
+        apply_curve(st->pre, x, n);
+        apply_curve(st->pre, y, n);
+        apply_curve(st->pre, z, n);
+        float m00 = st->m[0][0], m01 = st->m[0][1], m02 = st->m[0][2];
+        float m10 = st->m[1][0], m11 = st->m[1][1], m12 = st->m[1][2];
+        float m20 = st->m[2][0], m21 = st->m[2][1], m22 = st->m[2][2];
+        float b0 = st->bias[0], b1 = st->bias[1], b2 = st->bias[2];
+        #pragma omp simd
+        for(i = 0; i < n; ++i){
+            float a = x[i], b = y[i], c = z[i];
+            x[i] = m00*a + m01*b + m02*c + b0;
+            y[i] = m10*a + m11*b + m12*c + b1;
+            z[i] = m20*a + m21*b + m22*c + b2;
+        }
+        apply_curve(st->post, x, n);
+        apply_curve(st->post, y, n);
+        apply_curve(st->post, z, n);
+    }
+}
+
+// Converts an image with a pipeline in a single pass over its pixels.
+// image im: image in the pipeline's source space, 1 channel for
+//           COLOR_GRAY and 3 otherwise.
+// color_pipeline p: conversion to run.
+// returns: new image in the pipeline's destination space.
+image apply_color_pipeline(image im, color_pipeline p)
+{
+    if(!curves_ready) make_curve_luts();
+    int n = im.w*im.h;
+    int oc = (p.to == COLOR_GRAY) ? 1 : 3;
+    image out = make_image(im.w, im.h, oc);
+    int in1 = (im.c == 1);
+    int start;
+    #pragma omp parallel for
+    for(start = 0; start < n; start += COLOR_BLOCK){
+        float x[COLOR_BLOCK], y[COLOR_BLOCK], z[COLOR_BLOCK];
+        int len = MIN(COLOR_BLOCK, n - start);
+        memcpy(x, im.data + start, len*sizeof(float));
+        memcpy(y, im.data + (in1 ? 0 : n) + start, len*sizeof(float));
+        memcpy(z, im.data + (in1 ? 0 : 2*n) + start, len*sizeof(float));
+        run_stages(&p, x, y, z, len);
+        memcpy(out.data + start, x, len*sizeof(float));
+        if(oc == 3){
+            memcpy(out.data + n + start, y, len*sizeof(float));
+            memcpy(out.data + 2*n + start, z, len*sizeof(float));
+        }
+    }
+    return out;
+}
+
+// Converts an image between two colorspaces.
+// image im: image to convert.
+// COLORSPACE from, to: source and destination spaces.
+// returns: converted image.
+image convert_colorspace(image im, COLORSPACE from, COLORSPACE to)
+{
+    return apply_color_pipeline(im, make_color_pipeline(from, to));
+}
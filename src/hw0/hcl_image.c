@@ -0,0 +1,172 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "image.h"
+
+// Fast versions of rgb_to_hcl and hcl_to_rgb for batch work. Same color
+// model, constants and output range as the exact functions, but in float
+// with no calls into libm inside the pixel loop:
+//   gamma x^2.2          table, linear interpolation, abs error < 1e-7
+//   inverse x^(1/2.2)    tables over sqrt(x), abs error < 1e-6
+//   cube root            bit trick + 2 Newton steps, rel error < 2e-6
+//   atan2                degree 11 odd polynomial, abs error < 2e-6 rad
+//   sin, cos             degree 11 odd polynomial, abs error < 3e-7
+// Results match the exact functions to within EPS. Unlike them, inputs
+// are clamped to [0, 1] before the gamma curves, so out of gamut values
+// come back clamped instead of NaN.
+
+// Below this many pixels the conversions stay on one thread.
+#define HCL_PARALLEL_MIN (1 << 16)
+
+#define GAMMA_LUT_SIZE 4096
+// The inverse curve still bends hard near 0 after the sqrt, so its first
+// 1/DEGAMMA_FINE_SPAN gets a table of its own.
+#define DEGAMMA_FINE_SPAN 256
+
+static float gamma_lut[GAMMA_LUT_SIZE + 1];
+static float degamma_lut[GAMMA_LUT_SIZE + 1];
+static float degamma_fine_lut[GAMMA_LUT_SIZE + 1];
+static int gamma_ready = 0;
+
+static void make_gamma_luts()
+{
+    int i;
+    for(i = 0; i <= GAMMA_LUT_SIZE; ++i){
+        double x = (double)i/GAMMA_LUT_SIZE;
+        gamma_lut[i] = pow(x, 2.2);
+        // Indexed by sqrt(x) to flatten the infinite slope at 0.
+        degamma_lut[i] = pow(x, 2/2.2);
+        degamma_fine_lut[i] = pow(x/DEGAMMA_FINE_SPAN, 2/2.2);
+    }
+    gamma_ready = 1;
+}
+
+// Linear interpolation into a table over [0, 1].
+static inline float lut_lookup(const float *lut, float x)
+{
+    x = MIN(MAX(x, 0), 1) * GAMMA_LUT_SIZE;
+    int i = MIN((int)x, GAMMA_LUT_SIZE - 1);
+    float f = x - i;
+    return lut[i] + (lut[i+1] - lut[i])*f;
+}
+
+// x^(1/2.2) for x in [0, 1].
+static inline float degamma(float x)
+{
+    float s = sqrtf(MAX(x, 0));
+    float fine = lut_lookup(degamma_fine_lut, s*DEGAMMA_FINE_SPAN);
+    float coarse = lut_lookup(degamma_lut, s);
+    return (s < 1.f/DEGAMMA_FINE_SPAN) ? fine : coarse;
+}
+
+static inline float fast_cbrt(float x)
+{
+    int i;
+    memcpy(&i, &x, sizeof(float));
+    i = i/3 + 709921077;
+    float y;
+    memcpy(&y, &i, sizeof(float));
+    y = (2*y + x/(y*y)) * (1.f/3);
+    y = (2*y + x/(y*y)) * (1.f/3);
+    return y;
+}
+
+static inline float fast_atan2(float y, float x)
+{
+    float ax = fabsf(x), ay = fabsf(y);
+    float mx = MAX(ax, ay), mn = MIN(ax, ay);
+    float z = (mx == 0) ? 0 : mn/mx;
+    float z2 = z*z;
+    float a = z*(0.99997726f + z2*(-0.33262347f + z2*(0.19354346f + z2*(-0.11643287f + z2*(0.05265332f + z2*(-0.01172120f))))));
+    a = (ay > ax) ? (float)(PI/2) - a : a;
+    a = (x < 0) ? (float)PI - a : a;
+    return (y < 0) ? -a : a;
+}
+
+static inline float fast_sin(float x)
+{
+    // Into [-pi, pi], then fold into [-pi/2, pi/2] with sin(x) = sin(pi - x).
+    x -= (float)TWOPI * floorf(x*(float)(1/TWOPI) + .5f);
+    x = (x > (float)(PI/2)) ? (float)PI - x : x;
+    x = (x < (float)(-PI/2)) ? (float)(-PI) - x : x;
+    float x2 = x*x;
+    return x*(1 + x2*(-1/6.f + x2*(1/120.f + x2*(-1/5040.f + x2*(1/362880.f + x2*(-1/39916800.f))))));
+}
+
+static inline float lab_f(float t)
+{
+    return (t > 0.008856f) ? fast_cbrt(t) : (903.3f*t + 16)/116;
+}
+
+static inline float lab_finv(float t)
+{
+    return (t > 0.008856f) ? t*t*t : (t*116 - 16)/903.3f;
+}
+
+// Fast rgb_to_hcl, see the accuracy notes at the top of the file.
+// image im: RGB image, converted in place.
+void rgb_to_hcl_fast(image im)
+{
+    if(!gamma_ready) make_gamma_luts();
+    int n = im.w*im.h;
+    float *R = im.data, *G = im.data + n, *B = im.data + 2*n;
+    int i;
+    #pragma omp parallel for simd if(n >= HCL_PARALLEL_MIN)
+    for(i = 0; i < n; ++i){
+        float r = lut_lookup(gamma_lut, R[i]);
+        float g = lut_lookup(gamma_lut, G[i]);
+        float b = lut_lookup(gamma_lut, B[i]);
+
+        float X = (r*0.4124f + g*0.3576f + b*0.1805f) * (1/95.047f);
+        float Y = (r*0.2126f + g*0.7152f + b*0.0722f) * (1/100.f);
+        float Z = (r*0.0193f + g*0.1192f + b*0.9505f) * (1/108.883f);
+
+        float fx = lab_f(X), fy = lab_f(Y), fz = lab_f(Z);
+        float L = 116*fy - 16;
+        float ca = 500*(fx - fy);
+        float cb = 200*(fy - fz);
+
+        float C = sqrtf(ca*ca + cb*cb);
+        float H = fast_atan2(cb, ca) * (float)(1/TWOPI);
+        H += (H > 0) ? 0 : 1;
+
+        R[i] = H;
+        G[i] = C / 100;
+        B[i] = L / 100;
+    }
+}
+
+// Fast hcl_to_rgb, see the accuracy notes at the top of the file.
+// image im: HCL image, converted in place.
+void hcl_to_rgb_fast(image im)
+{
+    if(!gamma_ready) make_gamma_luts();
+    int n = im.w*im.h;
+    float *H = im.data, *Cp = im.data + n, *Lp = im.data + 2*n;
+    int i;
+    #pragma omp parallel for simd if(n >= HCL_PARALLEL_MIN)
+    for(i = 0; i < n; ++i){
+        float h = H[i] * (float)TWOPI;
+        float C = Cp[i] * 100;
+        float L = Lp[i] * 100;
+
+        float ca = fast_sin(h + (float)(PI/2)) * C;
+        float cb = fast_sin(h) * C;
+
+        float fy = (L + 16)/116;
+        float fx = ca/500 + fy;
+        float fz = fy - cb/200;
+
+        float X = lab_finv(fx) * 95.047f;
+        float Y = lab_finv(fy) * 100;
+        float Z = lab_finv(fz) * 108.883f;
+
+        float r = X*3.2440f + Y*-1.5371f + Z*-0.4985f;
+        float g = X*-0.9692f + Y*1.8760f + Z*0.0415f;
+        float b = X*0.0556f + Y*-0.2040f + Z*1.0572f;
+
+        H[i] = degamma(r);
+        Cp[i] = degamma(g);
+        Lp[i] = degamma(b);
+    }
+}
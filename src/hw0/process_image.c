@@ -55,38 +55,20 @@ image copy_image(image im)
 image rgb_to_grayscale(image im)
 {
     assert(im.c == 3);
-    image gray = make_image(im.w, im.h, 1);
-    for(int x = 0; x<im.w; x++) {
-        for(int y = 0; y<im.h; y++) {
-            float r = get_pixel(im, x, y, 0);
-            float g = get_pixel(im, x, y, 1);
-            float b = get_pixel(im, x, y, 2);
-            set_pixel(gray, x, y, 0, (0.299 * r + 0.587 * g + 0.114 * b));
-        }
-    }
-    return gray;
+    return convert_colorspace(im, COLOR_RGB, COLOR_GRAY);
 }
 
 void shift_image(image im, int c, float v)
 {
-    for(int x = 0; x<im.w; x++) {
-        for(int y = 0; y<im.h; y++) {
-            float pixel = get_pixel(im, x, y, c);
-            set_pixel(im, x, y, c, pixel + v);
-        }
-    }
+    c = MIN(MAX(c, 0), im.c - 1);
+    int n = im.w*im.h;
+    plane_affine(im.data + c*n, im.data + c*n, 1, v, n);
 }
 
 void clamp_image(image im)
 {
-    for(int x = 0; x<im.w; x++) {
-        for(int y = 0; y<im.h; y++) {
-            for(int c = 0; c<im.c; c++) {
-                float pixel = get_pixel(im, x, y, c);
-                set_pixel(im, x, y, c, MAX(MIN(pixel, 1), 0));
-            }
-        }
-    }
+    int n = im.w*im.h*im.c;
+    plane_clamp(im.data, im.data, 0, 1, n);
 }
 
 
@@ -101,90 +83,75 @@ float three_way_min(float a, float b, float c)
     return (a < b) ? ( (a < c) ? a : c) : ( (b < c) ? b : c) ;
 }
 
+// Below this many pixels color conversions stay on one thread.
+#define COLOR_PARALLEL_MIN (1 << 16)
+
+// Works on the three planes directly. Every branch of the usual hue
+// ladder is computed and the right one picked with selects, so the loop
+// has no control flow and vectorizes.
 void rgb_to_hsv(image im)
 {
-    float r, g, b, value, saturation, hue, m, ha, c;
-    for(int x = 0; x<im.w; x++) {
-        for(int y = 0; y<im.h; y++) {
-            r = get_pixel(im, x, y, 0);
-            g = get_pixel(im, x, y, 1);
-            b = get_pixel(im, x, y, 2);
-
-            value = three_way_max(r, g, b);
-            m = three_way_min(r, g, b);
-            c = value - m;
-            saturation = (value == 0 ? 0 : c / value);
-
-            if (c == 0) {
-                ha = 0;
-            } else if (value == r) {
-                ha = (g - b) / c;
-            } else if (value == g) {
-                ha = ((b - r) / c) + 2;
-            } else {
-                ha = ((r - g) / c) + 4;
-            }
-
-            hue = ha / 6;
-            if (ha < 0) {
-                hue += 1;
-            }
-
-            set_pixel(im, x, y, 0, hue);
-            set_pixel(im, x, y, 1, saturation);
-            set_pixel(im, x, y, 2, value);
-        }
+    assert(im.c == 3);
+    int n = im.w*im.h;
+    float *R = im.data, *G = im.data + n, *B = im.data + 2*n;
+    int i;
+    #pragma omp parallel for simd if(n >= COLOR_PARALLEL_MIN)
+    for(i = 0; i < n; ++i){
+        float r = R[i], g = G[i], b = B[i];
+        float value = MAX(MAX(r, g), b);
+        float m = MIN(MIN(r, g), b);
+        float c = value - m;
+        float saturation = (value == 0) ? 0 : c / value;
+
+        // With c == 0 every channel equals value, so the red case is
+        // taken and inv makes it 0.
+        float inv = (c == 0) ? 0 : 1 / c;
+        float hr = (g - b) * inv;
+        float hg = (b - r) * inv + 2;
+        float hb = (r - g) * inv + 4;
+        float ha = (value == r) ? hr : ((value == g) ? hg : hb);
+
+        float hue = ha / 6;
+        hue += (ha < 0) ? 1 : 0;
+
+        R[i] = hue;
+        G[i] = saturation;
+        B[i] = value;
     }
 }
 
-
+// Branchless sector lookup: channel n of the result is
+// v - v*s*clamp(min(k, 4 - k), 0, 1) with k = (n + 6h) mod 6, which gives
+// the same values as the six case switch for every sector.
 void hsv_to_rgb(image im)
 {
-    for(int x = 0; x<im.w; x++) {
-        for(int y = 0; y<im.h; y++) {
-            float hue = get_pixel(im, x, y, 0);
-            float saturation = get_pixel(im, x, y, 1);
-            float value = get_pixel(im, x, y, 2);
-
-            float r, g, b;
-
-            if (saturation == 0) {
-                r = value;
-                g = value;
-                b = value;
-            } else {
-                float h = hue * 6;
-                if (h == 6) h = 0;
-                int i = floor(h);
-                float x = value * (1 - saturation);
-                float y = value * (1 - saturation * (h - i));
-                float z = value * (1 - saturation * (1 - (h - i)));
-
-                switch (i) {
-                    case 0:  r = value; g = z;     b = x; break;
-                    case 1:  r = y;     g = value; b = x; break;
-                    case 2:  r = x;     g = value; b = z; break;
-                    case 3:  r = x;     g = y;     b = value; break;
-                    case 4:  r = z;     g = x;     b = value; break;
-                    default: r = value; g = x;     b = y;
-                }
-            }
-
-            set_pixel(im, x, y, 0, r);
-            set_pixel(im, x, y, 1, g);
-            set_pixel(im, x, y, 2, b);
-        }
+    assert(im.c == 3);
+    int n = im.w*im.h;
+    float *H = im.data, *S = im.data + n, *V = im.data + 2*n;
+    int i;
+    #pragma omp parallel for simd if(n >= COLOR_PARALLEL_MIN)
+    for(i = 0; i < n; ++i){
+        float h = H[i] * 6;
+        float vs = V[i] * S[i];
+
+        float kr = 5 + h; kr -= (kr >= 6) ? 6 : 0;
+        float kg = 3 + h; kg -= (kg >= 6) ? 6 : 0;
+        float kb = 1 + h; kb -= (kb >= 6) ? 6 : 0;
+        float tr = MAX(MIN(MIN(kr, 4 - kr), 1), 0);
+        float tg = MAX(MIN(MIN(kg, 4 - kg), 1), 0);
+        float tb = MAX(MIN(MIN(kb, 4 - kb), 1), 0);
+
+        H[i] = V[i] - vs*tr;
+        S[i] = V[i] - vs*tg;
+        V[i] = V[i] - vs*tb;
     }
 }
 
 void scale_image(image im, int c, float v)
 {
-    for(int x = 0; x<im.w; x++) {
-        for(int y = 0; y<im.h; y++) {
-            float pixel = get_pixel(im, x, y, c);
-            set_pixel(im, x, y, c, pixel * v);
-       }
-    }
+    c = MIN(MAX(c, 0), im.c - 1);
+    int n = im.w*im.h;
+    plane_affine(im.data + c*n, im.data + c*n, v, 0, n);
 }
 
 float absolute(float a)
@@ -0,0 +1,465 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "image.h"
+
+// Below this many output samples a resample stays on one thread.
+#define RESAMPLE_PARALLEL_MIN (1 << 16)
+
+// Source taps for every output position along one axis. Output i reads
+// source index[i*taps + k] with weight weight[i*taps + k], indices already
+// clamped to the image so the passes never bounds check.
+typedef struct{
+    int n, taps;
+    int *index;
+    float *weight;
+} resample_axis;
+
+// Cubic convolution kernel with a = -0.5 (Catmull-Rom), support 2.
+static float cubic_kernel(float x)
+{
+    x = fabsf(x);
+    if(x < 1) return (1.5f*x - 2.5f)*x*x + 1;
+    if(x < 2) return ((-0.5f*x + 2.5f)*x - 4)*x + 2;
+    return 0;
+}
+
+// Lanczos kernel with a = 3, support 3.
+static float lanczos_kernel(float x)
+{
+    x = fabsf(x);
+    if(x == 0) return 1;
+    if(x >= 3) return 0;
+    float px = (float)PI*x;
+    return 3*sinf(px)*sinf(px/3)/(px*px);
+}
+
+static float resample_kernel(RESAMPLE_FILTER f, float x)
+{
+    if(f == RESAMPLE_BICUBIC) return cubic_kernel(x);
+    if(f == RESAMPLE_LANCZOS) return lanczos_kernel(x);
+    return MAX(1 - fabsf(x), 0);
+}
+
+static int resample_radius(RESAMPLE_FILTER f)
+{
+    if(f == RESAMPLE_BICUBIC) return 2;
+    if(f == RESAMPLE_LANCZOS) return 3;
+    return 1;
+}
+
+// Builds the tap table for shrinking an axis by averaging. Output i covers
+// source span [i*scale, (i+1)*scale) and each source pixel is weighted by
+// how much of it falls inside, so every source pixel counts exactly once.
+static resample_axis make_area_axis(int in, int out, float scale)
+{
+    resample_axis a;
+    a.n = out;
+    a.taps = (int)ceilf(scale) + 1;
+    a.index = calloc(out*a.taps, sizeof(int));
+    a.weight = calloc(out*a.taps, sizeof(float));
+    int i, k;
+    for(i = 0; i < out; ++i){
+        float lo = i*scale, hi = lo + scale;
+        int first = (int)floorf(lo);
+        int *idx = a.index + i*a.taps;
+        float *w = a.weight + i*a.taps;
+        float sum = 0;
+        for(k = 0; k < a.taps; ++k){
+            int p = first + k;
+            idx[k] = MIN(MAX(p, 0), in - 1);
+            w[k] = MAX(MIN(hi, p + 1) - MAX(lo, p), 0);
+            sum += w[k];
+        }
+        for(k = 0; k < a.taps; ++k) w[k] /= sum;
+    }
+    return a;
+}
+
+// Builds the tap table for resizing an axis of length in to length out.
+// Output i samples source position i*scale + scale/2 - .5, which lines up
+// pixel centers, the same mapping nn_interpolate and bilinear_interpolate
+// are called with.
+static resample_axis make_resample_axis(int in, int out, RESAMPLE_FILTER f)
+{
+    float scale = (float)in / (float)out;
+    // Area averaging only differs from bilinear when shrinking.
+    if(f == RESAMPLE_AREA && scale <= 1) f = RESAMPLE_BILINEAR;
+    if(f == RESAMPLE_AREA) return make_area_axis(in, out, scale);
+
+    resample_axis a;
+    int r = resample_radius(f);
+    a.n = out;
+    a.taps = (f == RESAMPLE_NEAREST) ? 1 : 2*r;
+    a.index = calloc(out*a.taps, sizeof(int));
+    a.weight = calloc(out*a.taps, sizeof(float));
+
+    float offset = (scale/2) - 0.5;
+    int i, k;
+    for(i = 0; i < out; ++i){
+        float s = i*scale + offset;
+        int *idx = a.index + i*a.taps;
+        float *w = a.weight + i*a.taps;
+        if(f == RESAMPLE_NEAREST){
+            idx[0] = MIN(MAX((int)round(s), 0), in - 1);
+            w[0] = 1;
+            continue;
+        }
+        int first = (int)floorf(s) - r + 1;
+        float sum = 0;
+        for(k = 0; k < a.taps; ++k){
+            idx[k] = MIN(MAX(first + k, 0), in - 1);
+            w[k] = resample_kernel(f, s - (first + k));
+            sum += w[k];
+        }
+        if(f != RESAMPLE_BILINEAR && sum != 0){
+            for(k = 0; k < a.taps; ++k) w[k] /= sum;
+        }
+    }
+    return a;
+}
+
+static void free_resample_axis(resample_axis a)
+{
+    free(a.index);
+    free(a.weight);
+}
+
+// Exact integer factor fast paths. Each one gives the same samples as the
+// tap tables would for that factor (up to float rounding), just without the
+// gathers: replication and phase decimation for nearest, block averages
+// for bilinear halving and quartering and for area, and fixed .75/.25 taps
+// for bilinear doubling.
+
+// Nearest upsample by k: every source pixel becomes a k x k block.
+static void replicate_image(image im, image out, int k)
+{
+    int rows = out.c*out.h;
+    int r;
+    #pragma omp parallel for if(out.w*rows >= RESAMPLE_PARALLEL_MIN)
+    for(r = 0; r < rows; ++r){
+        int c = r / out.h, y = r % out.h;
+        const float *src = im.data + (c*im.h + y/k)*im.w;
+        float *dst = out.data + r*out.w;
+        int x;
+        #pragma omp simd
+        for(x = 0; x < out.w; ++x) dst[x] = src[x/k];
+    }
+}
+
+// Nearest downsample by k: keeps source pixel k*x + k/2, the one whose
+// center nn_interpolate rounds to.
+static void decimate_image(image im, image out, int k)
+{
+    int rows = out.c*out.h;
+    int r;
+    #pragma omp parallel for if(out.w*rows >= RESAMPLE_PARALLEL_MIN)
+    for(r = 0; r < rows; ++r){
+        int c = r / out.h, y = r % out.h;
+        const float *src = im.data + (c*im.h + k*y + k/2)*im.w + k/2;
+        float *dst = out.data + r*out.w;
+        int x;
+        #pragma omp simd
+        for(x = 0; x < out.w; ++x) dst[x] = src[k*x];
+    }
+}
+
+// Downsample by k averaging the n x n block that starts phase pixels into
+// each k x k cell. Rows are summed first so the adds run over contiguous
+// memory, then neighbors are summed pairwise across the row.
+static void average_image(image im, image out, int k, int phase, int n)
+{
+    int rows = out.c*out.h;
+    float norm = 1.f/(n*n);
+    #pragma omp parallel if(out.w*rows >= RESAMPLE_PARALLEL_MIN)
+    {
+        float *sum = calloc(im.w, sizeof(float));
+        int r;
+        #pragma omp for
+        for(r = 0; r < rows; ++r){
+            int c = r / out.h, y = r % out.h;
+            const float *src = im.data + (c*im.h + k*y + phase)*im.w;
+            float *dst = out.data + r*out.w;
+            int x, j;
+            #pragma omp simd
+            for(x = 0; x < im.w; ++x) sum[x] = src[x] + src[im.w + x];
+            for(j = 2; j < n; ++j){
+                const float *row = src + j*im.w;
+                #pragma omp simd
+                for(x = 0; x < im.w; ++x) sum[x] += row[x];
+            }
+            const float *s = sum + phase;
+            if(n == 2){
+                #pragma omp simd
+                for(x = 0; x < out.w; ++x) dst[x] = (s[k*x] + s[k*x + 1])*norm;
+            } else {
+                #pragma omp simd
+                for(x = 0; x < out.w; ++x) dst[x] = ((s[k*x] + s[k*x + 1]) + (s[k*x + 2] + s[k*x + 3]))*norm;
+            }
+        }
+        free(sum);
+    }
+}
+
+// Bilinear upsample by 2. Output 2m samples source m - .25 and output
+// 2m + 1 samples m + .25, so both blend pixel m at .75 with a clamped
+// neighbor at .25, first down the columns and then along the row.
+static void double_image(image im, image out)
+{
+    int rows = out.c*out.h;
+    #pragma omp parallel if(out.w*rows >= RESAMPLE_PARALLEL_MIN)
+    {
+        float *v = calloc(im.w + 2, sizeof(float));
+        int r;
+        #pragma omp for
+        for(r = 0; r < rows; ++r){
+            int c = r / out.h, y = r % out.h;
+            int m = y/2;
+            int n = (y & 1) ? MIN(m + 1, im.h - 1) : MAX(m - 1, 0);
+            const float *a = im.data + (c*im.h + m)*im.w;
+            const float *b = im.data + (c*im.h + n)*im.w;
+            float *dst = out.data + r*out.w;
+            int x;
+            #pragma omp simd
+            for(x = 0; x < im.w; ++x) v[x + 1] = .75f*a[x] + .25f*b[x];
+            v[0] = v[1];
+            v[im.w + 1] = v[im.w];
+            #pragma omp simd
+            for(x = 0; x < im.w; ++x){
+                dst[2*x] = .75f*v[x + 1] + .25f*v[x];
+                dst[2*x + 1] = .75f*v[x + 1] + .25f*v[x + 2];
+            }
+        }
+        free(v);
+    }
+}
+
+// Picks a fast path when both axes change by the same exact factor.
+// returns: 1 and fills out if one applied, 0 to use the tap tables.
+static int resample_integer(image im, int w, int h, RESAMPLE_FILTER f, image *out)
+{
+    if(f == RESAMPLE_AREA && w >= im.w && h >= im.h) f = RESAMPLE_BILINEAR;
+    if(w > im.w && w % im.w == 0 && w/im.w == h/im.h && h % im.h == 0){
+        int k = w/im.w;
+        if(f == RESAMPLE_NEAREST){
+            *out = make_image(w, h, im.c);
+            replicate_image(im, *out, k);
+            return 1;
+        }
+        if(f == RESAMPLE_BILINEAR && k == 2){
+            *out = make_image(w, h, im.c);
+            double_image(im, *out);
+            return 1;
+        }
+    }
+    if(w < im.w && w > 0 && h > 0 && im.w % w == 0 && im.w/w == im.h/h && im.h % h == 0){
+        int k = im.w/w;
+        if(f == RESAMPLE_NEAREST){
+            *out = make_image(w, h, im.c);
+            decimate_image(im, *out, k);
+            return 1;
+        }
+        if((f == RESAMPLE_BILINEAR || f == RESAMPLE_AREA) && k == 2){
+            *out = make_image(w, h, im.c);
+            average_image(im, *out, 2, 0, 2);
+            return 1;
+        }
+        if(f == RESAMPLE_BILINEAR && k == 4){
+            *out = make_image(w, h, im.c);
+            average_image(im, *out, 4, 1, 2);
+            return 1;
+        }
+        if(f == RESAMPLE_AREA && k == 4){
+            *out = make_image(w, h, im.c);
+            average_image(im, *out, 4, 0, 4);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Resizes an image with a separable filter. Tap tables for columns and rows
+// are built once, then a horizontal pass filters every needed source row
+// into a w x im.h temporary and a vertical pass blends whole rows of it, so
+// the inner loops of the second pass run over contiguous memory. Exact
+// integer factors take a fast path instead, see resample_integer.
+// Interpolating kernels are not widened when shrinking and will alias,
+// RESAMPLE_AREA averages the covered source pixels instead, which equals a
+// box blur followed by sampling for integer factors.
+// image im: image to resize.
+// int w, h: size of the result.
+// RESAMPLE_FILTER f: interpolation kernel.
+// returns: resized image.
+image resample_image(image im, int w, int h, RESAMPLE_FILTER f)
+{
+    image out;
+    if(resample_integer(im, w, h, f, &out)) return out;
+
+    out = make_image(w, h, im.c);
+    resample_axis ax = make_resample_axis(im.w, w, f);
+    resample_axis ay = make_resample_axis(im.h, h, f);
+    image tmp = make_image(w, im.h, im.c);
+
+    // Only source rows some output row actually reads need the first pass.
+    char *used = calloc(im.h, sizeof(char));
+    int i;
+    for(i = 0; i < h*ay.taps; ++i){
+        if(ay.weight[i] != 0) used[ay.index[i]] = 1;
+    }
+
+    int rows = im.c*im.h;
+    int r;
+    #pragma omp parallel for if(w*rows >= RESAMPLE_PARALLEL_MIN)
+    for(r = 0; r < rows; ++r){
+        if(!used[r % im.h]) continue;
+        const float *src = im.data + r*im.w;
+        float *dst = tmp.data + r*w;
+        int x, k;
+        for(x = 0; x < w; ++x){
+            const int *idx = ax.index + x*ax.taps;
+            const float *wt = ax.weight + x*ax.taps;
+            float sum = 0;
+            for(k = 0; k < ax.taps; ++k) sum += wt[k]*src[idx[k]];
+            dst[x] = sum;
+        }
+    }
+
+    rows = im.c*h;
+    #pragma omp parallel for if(w*rows >= RESAMPLE_PARALLEL_MIN)
+    for(r = 0; r < rows; ++r){
+        int c = r / h, y = r % h;
+        const int *idx = ay.index + y*ay.taps;
+        const float *wt = ay.weight + y*ay.taps;
+        const float *plane = tmp.data + c*w*im.h;
+        float *dst = out.data + r*w;
+        const float *src = plane + idx[0]*w;
+        float w0 = wt[0];
+        int x, k;
+        #pragma omp simd
+        for(x = 0; x < w; ++x) dst[x] = w0*src[x];
+        for(k = 1; k < ay.taps; ++k){
+            float wk = wt[k];
+            if(wk == 0) continue;
+            src = plane + idx[k]*w;
+            #pragma omp simd
+            for(x = 0; x < w; ++x) dst[x] += wk*src[x];
+        }
+    }
+
+    free(used);
+    free_image(tmp);
+    free_resample_axis(ax);
+    free_resample_axis(ay);
+    return out;
+}
+
+// Fixed point fraction bits for 8 bit resampling weights.
+#define RESAMPLE_U8_BITS 14
+
+// Converts an axis' weights to fixed point, pushing each output's rounding
+// error onto its largest tap so every row of weights sums to one exactly.
+static int *quantize_axis(resample_axis a)
+{
+    int *q = calloc(a.n*a.taps, sizeof(int));
+    int i, k;
+    for(i = 0; i < a.n; ++i){
+        const float *w = a.weight + i*a.taps;
+        int *qi = q + i*a.taps;
+        int sum = 0, big = 0;
+        for(k = 0; k < a.taps; ++k){
+            qi[k] = (int)lroundf(w[k]*(1 << RESAMPLE_U8_BITS));
+            sum += qi[k];
+            if(w[k] > w[big]) big = k;
+        }
+        qi[big] += (1 << RESAMPLE_U8_BITS) - sum;
+    }
+    return q;
+}
+
+static inline unsigned char resample_u8_round(int v)
+{
+    v = (v + (1 << (RESAMPLE_U8_BITS - 1))) >> RESAMPLE_U8_BITS;
+    return MIN(MAX(v, 0), 255);
+}
+
+// 8 bit resample_image: same tap tables with fixed point weights, and both
+// passes rounded back to 8 bits. Bicubic and Lanczos overshoot is clamped.
+// Works on either layout and keeps it. Interleaved rows are blended in the
+// vertical pass as one run of w*c bytes.
+// image_u8 im: image to resize.
+// int w, h: size of the result.
+// RESAMPLE_FILTER f: interpolation kernel.
+// returns: resized image.
+image_u8 resample_image_u8(image_u8 im, int w, int h, RESAMPLE_FILTER f)
+{
+    image_u8 out = make_image_u8_layout(w, h, im.c, im.layout);
+    resample_axis ax = make_resample_axis(im.w, w, f);
+    resample_axis ay = make_resample_axis(im.h, h, f);
+    int *qx = quantize_axis(ax);
+    int *qy = quantize_axis(ay);
+    image_u8 tmp = make_image_u8_layout(w, im.h, im.c, im.layout);
+    int ps, cs, tps, tcs;
+    u8_strides(im, &ps, &cs);
+    u8_strides(tmp, &tps, &tcs);
+
+    char *used = calloc(im.h, sizeof(char));
+    int i;
+    for(i = 0; i < h*ay.taps; ++i){
+        if(qy[i] != 0) used[ay.index[i]] = 1;
+    }
+
+    int rows = im.c*im.h;
+    int r;
+    #pragma omp parallel for if(w*rows >= RESAMPLE_PARALLEL_MIN)
+    for(r = 0; r < rows; ++r){
+        int c = r / im.h, y = r % im.h;
+        if(!used[y]) continue;
+        const unsigned char *src = im.data + c*cs + y*im.w*ps;
+        unsigned char *dst = tmp.data + c*tcs + y*w*tps;
+        int x, k;
+        for(x = 0; x < w; ++x){
+            const int *idx = ax.index + x*ax.taps;
+            const int *wt = qx + x*ax.taps;
+            int sum = 0;
+            for(k = 0; k < ax.taps; ++k) sum += wt[k]*src[idx[k]*ps];
+            dst[x*tps] = resample_u8_round(sum);
+        }
+    }
+
+    // A planar image is c*h rows of w samples, an interleaved one h rows
+    // of w*c, either way each row is contiguous.
+    int planes = (im.layout == LAYOUT_INTERLEAVED) ? 1 : im.c;
+    int len = w*im.c/planes;
+    rows = planes*h;
+    #pragma omp parallel if(len*rows >= RESAMPLE_PARALLEL_MIN)
+    {
+        int *acc = calloc(len, sizeof(int));
+        #pragma omp for
+        for(r = 0; r < rows; ++r){
+            int c = r / h, y = r % h;
+            const int *idx = ay.index + y*ay.taps;
+            const int *wt = qy + y*ay.taps;
+            const unsigned char *plane = tmp.data + c*len*im.h;
+            unsigned char *dst = out.data + r*len;
+            int x, k;
+            memset(acc, 0, len*sizeof(int));
+            for(k = 0; k < ay.taps; ++k){
+                int wk = wt[k];
+                if(wk == 0) continue;
+                const unsigned char *src = plane + idx[k]*len;
+                #pragma omp simd
+                for(x = 0; x < len; ++x) acc[x] += wk*src[x];
+            }
+            for(x = 0; x < len; ++x) dst[x] = resample_u8_round(acc[x]);
+        }
+        free(acc);
+    }
+
+    free(used);
+    free(qx);
+    free(qy);
+    free_image_u8(tmp);
+    free_resample_axis(ax);
+    free_resample_axis(ay);
+    return out;
+}
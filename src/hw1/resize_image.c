@@ -8,22 +8,7 @@ float nn_interpolate(image im, float x, float y, int c)
 
 image nn_resize(image im, int w, int h)
 {
-    image resized_image = make_image(w, h, im.c);
-    float x_step = (float)im.w / (float)w;
-    float y_step = (float)im.h / (float)h;
-
-    float x_offset = (x_step/2) - 0.5;
-    float y_offset = (y_step/2) - 0.5;
-
-    for(int x = 0; x<w; x++) {
-        for(int y = 0; y<h; y++) {
-            for(int c = 0; c<im.c; c++) {
-                set_pixel(resized_image, x, y, c, nn_interpolate(im, x*x_step + x_offset, y*y_step + y_offset, c));
-            }
-        }
-    }
-
-    return resized_image;
+    return resample_image(im, w, h, RESAMPLE_NEAREST);
 }
 
 float bilinear_interpolate(image im, float x, float y, int c)
@@ -48,21 +33,5 @@ float bilinear_interpolate(image im, float x, float y, int c)
 
 image bilinear_resize(image im, int w, int h)
 {
-    image resized_image = make_image(w, h, im.c);
-    float x_step = (float)im.w / (float)w;
-    float y_step = (float)im.h / (float)h;
-
-    float x_offset = (x_step/2) - 0.5;
-    float y_offset = (y_step/2) - 0.5;
-
-    for(int x = 0; x<w; x++) {
-        for(int y = 0; y<h; y++) {
-            for(int c = 0; c<im.c; c++) {
-                set_pixel(resized_image, x, y, c, bilinear_interpolate(im, x*x_step + x_offset, y*y_step + y_offset, c));
-            }
-        }
-    }
-
-    return resized_image;
+    return resample_image(im, w, h, RESAMPLE_BILINEAR);
 }
-
@@ -131,34 +131,20 @@ image make_gaussian_filter(float sigma)
 
 image add_image(image a, image b)
 {
-    assert(a.w == b.w || a.h == b.h || a.c == b.c);
+    assert(a.w == b.w && a.h == b.h && a.c == b.c);
     
     image out = make_image(a.w, a.h, a.c);
-
-    for(int x = 0; x<a.w; x++) {
-        for(int y = 0; y<a.h; y++) {
-            for(int z = 0; z<a.c; z++) {
-                set_pixel(out, x, y, z, get_pixel(a, x, y, z) + get_pixel(b, x, y, z));
-            }
-        }
-    }
+    plane_add(out.data, a.data, b.data, a.w*a.h*a.c);
 
     return out;
 }
 
 image sub_image(image a, image b)
 {
-    assert(a.w == b.w || a.h == b.h || a.c == b.c);
+    assert(a.w == b.w && a.h == b.h && a.c == b.c);
     
     image out = make_image(a.w, a.h, a.c);
-
-    for(int x = 0; x<a.w; x++) {
-        for(int y = 0; y<a.h; y++) {
-            for(int z = 0; z<a.c; z++) {
-                set_pixel(out, x, y, z, get_pixel(a, x, y, z) - get_pixel(b, x, y, z));
-            }
-        }
-    }
+    plane_sub(out.data, a.data, b.data, a.w*a.h*a.c);
     
     return out;
 }
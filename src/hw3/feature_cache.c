@@ -0,0 +1,226 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "image.h"
+
+// Number of feature sets kept in memory.
+#define FEATURE_CACHE_SIZE 16
+
+// "UWFT" little endian, start of every cache file.
+#define FEATURE_CACHE_MAGIC 0x54465755
+#define FEATURE_CACHE_VERSION 1
+
+typedef struct{
+    unsigned long long key;
+    int n;
+    descriptor *d;
+} feature_entry;
+
+static feature_entry feature_cache[FEATURE_CACHE_SIZE];
+static int feature_cache_next = 0;
+static int feature_cache_on = 0;
+static char *feature_cache_dir = 0;
+
+// Folds bytes into a 64 bit FNV-1a hash.
+// unsigned long long h: hash so far.
+// const void *data: bytes to add.
+// size_t n: number of bytes.
+// returns: updated hash.
+static unsigned long long fnv1a(unsigned long long h, const void *data, size_t n)
+{
+    const unsigned char *p = data;
+    size_t i;
+    for(i = 0; i < n; ++i){
+        h ^= p[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// Hashes an image and the detection options that produce its features.
+// image im: image features are detected in.
+// harris_params p: detection options.
+// returns: cache key.
+unsigned long long feature_cache_key(image im, harris_params p)
+{
+    unsigned long long h = 14695981039346656037ULL;
+    h = fnv1a(h, &im.w, sizeof(int));
+    h = fnv1a(h, &im.h, sizeof(int));
+    h = fnv1a(h, &im.c, sizeof(int));
+    h = fnv1a(h, im.data, (size_t)im.w*im.h*im.c*sizeof(float));
+    // Field by field so struct padding never leaks into the key.
+    h = fnv1a(h, &p.sigma, sizeof(float));
+    h = fnv1a(h, &p.thresh, sizeof(float));
+    h = fnv1a(h, &p.nms, sizeof(int));
+    h = fnv1a(h, &p.max_corners, sizeof(int));
+    h = fnv1a(h, &p.grid, sizeof(int));
+    h = fnv1a(h, &p.binary, sizeof(int));
+    h = fnv1a(h, &p.subpixel, sizeof(int));
+    h = fnv1a(h, &p.octaves, sizeof(int));
+    h = fnv1a(h, &p.oriented, sizeof(int));
+    return h;
+}
+
+// Deep copies an array of descriptors.
+static descriptor *copy_descriptors(descriptor *d, int n)
+{
+    descriptor *c = calloc(n ? n : 1, sizeof(descriptor));
+    int i;
+    for(i = 0; i < n; ++i){
+        c[i] = d[i];
+        if(d[i].data){
+            c[i].data = calloc(d[i].n, sizeof(float));
+            memcpy(c[i].data, d[i].data, d[i].n*sizeof(float));
+        }
+        if(d[i].bits){
+            c[i].bits = calloc(d[i].n/64, sizeof(unsigned long long));
+            memcpy(c[i].bits, d[i].bits, d[i].n/64*sizeof(unsigned long long));
+        }
+    }
+    return c;
+}
+
+static void feature_cache_path(unsigned long long key, char *buff, size_t size)
+{
+    snprintf(buff, size, "%s/%016llx.feat", feature_cache_dir, key);
+}
+
+// Writes descriptors to a cache file: header of magic, version, count,
+// then for each descriptor x, y, n, a kind flag and the payload.
+static void save_features(const char *fname, descriptor *d, int n)
+{
+    FILE *fp = fopen(fname, "wb");
+    if(!fp) return;
+    int header[3] = {FEATURE_CACHE_MAGIC, FEATURE_CACHE_VERSION, n};
+    fwrite(header, sizeof(int), 3, fp);
+    int i;
+    for(i = 0; i < n; ++i){
+        int binary = d[i].bits != 0;
+        fwrite(&d[i].p, sizeof(point), 1, fp);
+        fwrite(&d[i].n, sizeof(int), 1, fp);
+        fwrite(&binary, sizeof(int), 1, fp);
+        if(binary) fwrite(d[i].bits, sizeof(unsigned long long), d[i].n/64, fp);
+        else fwrite(d[i].data, sizeof(float), d[i].n, fp);
+    }
+    fclose(fp);
+}
+
+// Reads a cache file written by save_features.
+// returns: descriptors, or 0 if the file is missing or malformed.
+static descriptor *load_features(const char *fname, int *n)
+{
+    FILE *fp = fopen(fname, "rb");
+    if(!fp) return 0;
+    int header[3] = {0};
+    if(fread(header, sizeof(int), 3, fp) != 3 || header[0] != FEATURE_CACHE_MAGIC ||
+       header[1] != FEATURE_CACHE_VERSION || header[2] < 0){
+        fclose(fp);
+        return 0;
+    }
+    int count = header[2];
+    descriptor *d = calloc(count ? count : 1, sizeof(descriptor));
+    int i, ok = 1;
+    for(i = 0; i < count && ok; ++i){
+        int binary = 0;
+        ok = fread(&d[i].p, sizeof(point), 1, fp) == 1 &&
+             fread(&d[i].n, sizeof(int), 1, fp) == 1 &&
+             fread(&binary, sizeof(int), 1, fp) == 1 &&
+             d[i].n > 0 && d[i].n < (1 << 20);
+        if(!ok) break;
+        if(binary){
+            d[i].bits = calloc(d[i].n/64, sizeof(unsigned long long));
+            ok = fread(d[i].bits, sizeof(unsigned long long), d[i].n/64, fp) == (size_t)d[i].n/64;
+        } else {
+            d[i].data = calloc(d[i].n, sizeof(float));
+            ok = fread(d[i].data, sizeof(float), d[i].n, fp) == (size_t)d[i].n;
+        }
+    }
+    fclose(fp);
+    if(!ok){
+        free_descriptors(d, count);
+        return 0;
+    }
+    *n = count;
+    return d;
+}
+
+static void remember_features(unsigned long long key, descriptor *d, int n)
+{
+    feature_entry *e = &feature_cache[feature_cache_next];
+    feature_cache_next = (feature_cache_next + 1) % FEATURE_CACHE_SIZE;
+    if(e->d) free_descriptors(e->d, e->n);
+    e->key = key;
+    e->n = n;
+    e->d = copy_descriptors(d, n);
+}
+
+// Turns on feature caching. Detected features are kept in memory and,
+// if a directory is given, also written there so later runs can reuse them.
+// const char *dir: directory for cache files, 0 for memory only.
+void enable_feature_cache(const char *dir)
+{
+    free(feature_cache_dir);
+    feature_cache_dir = dir ? strdup(dir) : 0;
+    feature_cache_on = 1;
+}
+
+// Turns off feature caching and drops everything kept in memory.
+// Cache files on disk are left alone.
+void disable_feature_cache()
+{
+    int i;
+    for(i = 0; i < FEATURE_CACHE_SIZE; ++i){
+        if(feature_cache[i].d) free_descriptors(feature_cache[i].d, feature_cache[i].n);
+    }
+    memset(feature_cache, 0, sizeof(feature_cache));
+    feature_cache_next = 0;
+    free(feature_cache_dir);
+    feature_cache_dir = 0;
+    feature_cache_on = 0;
+}
+
+// Looks up features for an image, in memory first and then on disk.
+// image im: image features are detected in.
+// harris_params p: detection options.
+// int *n: filled with number of descriptors on a hit.
+// returns: copy of the cached descriptors, caller frees them, 0 on a miss.
+descriptor *feature_cache_lookup(image im, harris_params p, int *n)
+{
+    if(!feature_cache_on) return 0;
+    unsigned long long key = feature_cache_key(im, p);
+    int i;
+    for(i = 0; i < FEATURE_CACHE_SIZE; ++i){
+        feature_entry e = feature_cache[i];
+        if(e.d && e.key == key){
+            *n = e.n;
+            return copy_descriptors(e.d, e.n);
+        }
+    }
+    if(!feature_cache_dir) return 0;
+    char fname[4096];
+    feature_cache_path(key, fname, sizeof(fname));
+    int count = 0;
+    descriptor *d = load_features(fname, &count);
+    if(!d) return 0;
+    remember_features(key, d, count);
+    *n = count;
+    return d;
+}
+
+// Stores features for an image.
+// image im: image features were detected in.
+// harris_params p: detection options.
+// descriptor *d: descriptors to store, copied.
+// int n: number of descriptors.
+void feature_cache_store(image im, harris_params p, descriptor *d, int n)
+{
+    if(!feature_cache_on) return;
+    unsigned long long key = feature_cache_key(im, p);
+    remember_features(key, d, n);
+    if(feature_cache_dir){
+        char fname[4096];
+        feature_cache_path(key, fname, sizeof(fname));
+        save_features(fname, d, n);
+    }
+}
@@ -6,6 +6,10 @@
 #include "image.h"
 #include "matrix.h"
 #include <time.h>
+#include <float.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 // Frees an array of descriptors.
 // descriptor *d: the array.
@@ -15,6 +19,7 @@ void free_descriptors(descriptor *d, int n)
     int i;
     for(i = 0; i < n; ++i){
         free(d[i].data);
+        free(d[i].bits);
     }
     free(d);
 }
@@ -31,6 +36,7 @@ descriptor describe_index(image im, int i)
     d.p.y = i/im.w;
     d.data = calloc(w*w*im.c, sizeof(float));
     d.n = w*w*im.c;
+    d.bits = 0;
     int c, dx, dy;
     int count = 0;
     // If you want you can experiment with other descriptors
@@ -48,6 +54,160 @@ descriptor describe_index(image im, int i)
     return d;
 }
 
+// Half-width of the patch binary descriptors sample from.
+#define BRIEF_RADIUS 15
+
+// Number of orientations rotated sampling patterns are precomputed for.
+#define ORIENT_BINS 32
+
+// Pixel pairs compared by binary descriptors, dx1, dy1, dx2, dy2 each,
+// rotated to every orientation bin. Bin 0 is the unrotated pattern.
+static signed char brief_pattern[ORIENT_BINS][BRIEF_BITS][4];
+static int brief_ready = 0;
+
+// Offsets of the 5x5 float descriptor patch, rotated to every bin.
+static signed char patch_pattern[ORIENT_BINS][25][2];
+static int patch_ready = 0;
+
+// Orientation bin for an angle.
+// float angle: angle in radians.
+// returns: nearest of ORIENT_BINS bins, 0 is angle 0.
+static int orient_bin(float angle)
+{
+    int b = (int)roundf(angle*ORIENT_BINS/TWOPI) % ORIENT_BINS;
+    return b < 0 ? b + ORIENT_BINS : b;
+}
+
+// Rotates an integer offset to orientation bin b and rounds it back
+// to the pixel grid.
+static void rotate_offset(int b, float x, float y, signed char *out)
+{
+    float a = b*TWOPI/ORIENT_BINS;
+    float c = cosf(a), s = sinf(a);
+    out[0] = (signed char)roundf(c*x - s*y);
+    out[1] = (signed char)roundf(s*x + c*y);
+}
+
+// Fills patch_pattern, same sample order as describe_index.
+static void make_patch_pattern()
+{
+    int b, dx, dy;
+    for(b = 0; b < ORIENT_BINS; ++b){
+        int k = 0;
+        for(dx = -2; dx <= 2; ++dx){
+            for(dy = -2; dy <= 2; ++dy){
+                rotate_offset(b, dx, dy, patch_pattern[b][k++]);
+            }
+        }
+    }
+    patch_ready = 1;
+}
+
+// Fills brief_pattern with pairs drawn from an isotropic Gaussian around
+// the keypoint (sigma = patch/5, BRIEF's G II layout). Uses its own fixed
+// generator so descriptors don't depend on the state of rand().
+static void make_brief_pattern()
+{
+    unsigned int state = 2463534242u;
+    int i, j;
+    for(i = 0; i < BRIEF_BITS; ++i){
+        for(j = 0; j < 4; ++j){
+            float v;
+            do {
+                // Sum of uniforms is close enough to Gaussian here.
+                float u = 0;
+                int k;
+                for(k = 0; k < 4; ++k){
+                    state ^= state << 13; state ^= state >> 17; state ^= state << 5;
+                    u += (state & 0xffff)/65535.f - .5f;
+                }
+                v = u * 2*BRIEF_RADIUS/5.f * 1.7320508f;
+            } while (fabs(v) > BRIEF_RADIUS);
+            brief_pattern[0][i][j] = (signed char)roundf(v);
+        }
+    }
+    int b;
+    for(b = 1; b < ORIENT_BINS; ++b){
+        for(i = 0; i < BRIEF_BITS; ++i){
+            signed char *t = brief_pattern[0][i];
+            rotate_offset(b, t[0], t[1], brief_pattern[b][i]);
+            rotate_offset(b, t[2], t[3], brief_pattern[b][i] + 2);
+        }
+    }
+    brief_ready = 1;
+}
+
+// Create a rotation invariant feature descriptor for a pixel: the same
+// samples as describe_index, taken on a grid turned to the keypoint's
+// orientation.
+// image im: source image.
+// int x, y: pixel to describe.
+// float angle: orientation of the keypoint.
+// returns: descriptor for that pixel.
+descriptor describe_oriented(image im, int x, int y, float angle)
+{
+    if(!patch_ready) make_patch_pattern();
+    descriptor d;
+    d.p.x = x;
+    d.p.y = y;
+    d.data = calloc(25*im.c, sizeof(float));
+    d.n = 25*im.c;
+    d.bits = 0;
+    signed char (*pattern)[2] = patch_pattern[orient_bin(angle)];
+    int c, k;
+    int count = 0;
+    for(c = 0; c < im.c; ++c){
+        float cval = im.data[c*im.w*im.h + x + y*im.w];
+        for(k = 0; k < 25; ++k){
+            d.data[count++] = cval - get_pixel(im, x + pattern[k][0], y + pattern[k][1], c);
+        }
+    }
+    return d;
+}
+
+// Prepares an image for binary descriptors: grayscale, then a 5x5 box
+// blur through an integral image so single-pixel noise doesn't flip bits.
+// image im: source image.
+// returns: smoothed 1-channel image.
+image brief_smooth_image(image im)
+{
+    image gray;
+    if(im.c == 3){
+        gray = rgb_to_grayscale(im);
+    } else {
+        gray = make_image(im.w, im.h, 1);
+        memcpy(gray.data, im.data, im.w*im.h*sizeof(float));
+    }
+    image smooth = box_filter_image(gray, 5);
+    free_image(gray);
+    return smooth;
+}
+
+// Create a binary (BRIEF-style) descriptor for a pixel.
+// image smooth: 1-channel image from brief_smooth_image.
+// int x, y: pixel to describe.
+// float angle: orientation of the keypoint, the pattern is rotated to match.
+// returns: descriptor with BRIEF_BITS bits in d.bits, d.data is empty.
+descriptor describe_binary(image smooth, int x, int y, float angle)
+{
+    if(!brief_ready) make_brief_pattern();
+    descriptor d;
+    d.p.x = x;
+    d.p.y = y;
+    d.n = BRIEF_BITS;
+    d.data = 0;
+    d.bits = calloc(BRIEF_BITS/64, sizeof(unsigned long long));
+    int i;
+    signed char (*pattern)[4] = brief_pattern[orient_bin(angle)];
+    for(i = 0; i < BRIEF_BITS; ++i){
+        signed char *t = pattern[i];
+        float a = get_pixel(smooth, x + t[0], y + t[1], 0);
+        float b = get_pixel(smooth, x + t[2], y + t[3], 0);
+        if(a < b) d.bits[i/64] |= 1ULL << (i%64);
+    }
+    return d;
+}
+
 // Marks the spot of a point in an image.
 // image im: image to mark.
 // ponit p: spot to mark in the image.
@@ -133,7 +293,7 @@ image smooth_image(image im, float sigma)
 //          third channel is IxIy.
 image structure_matrix(image im, float sigma)
 {
-    image S = make_image(im.w, im.h, 3);
+    image S = make_image_uninit(im.w, im.h, 3);
 
     image x_filter = make_gx_filter();
     image y_filter = make_gy_filter();
@@ -153,9 +313,15 @@ image structure_matrix(image im, float sigma)
 
     image filter = make_gaussian_filter(sigma);
 
-    S = convolve_image(S, filter, 1);
+    image blurred = convolve_image(S, filter, 1);
 
-    return S;
+    free_image(x_filter);
+    free_image(y_filter);
+    free_image(im_x);
+    free_image(im_y);
+    free_image(filter);
+    free_image(S);
+    return blurred;
 }
 
 // Estimate the cornerness of each pixel given a structure matrix S.
@@ -187,6 +353,85 @@ image cornerness_response(image S)
     return R;
 }
 
+// Running max over windows of 2w+1 consecutive lines, clamped at the ends.
+// Uses the van Herk/Gil-Werman trick: split the (padded) sequence into
+// blocks of 2w+1, take prefix maxes g and suffix maxes h within each block,
+// then every window is max(h[start], g[end]). Three comparisons per element
+// no matter how big w is. Each "line" is len contiguous floats and the
+// inner loops run along it, so vertical passes vectorize.
+// const float *in: first line of input.
+// float *out: first line of output.
+// int n: number of lines.
+// int stride: distance in floats between consecutive lines.
+// int len: number of floats in a line.
+// int w: window radius.
+// float *g, *h: scratch, each at least (n + 4*w + 1)*len floats.
+static void running_max_lines(const float *in, float *out, int n, int stride, int len, int w, float *g, float *h)
+{
+    int k = 2*w + 1;
+    int m = ((n + 2*w + k - 1)/k)*k;
+    int e, i, j;
+    for(e = 0; e < m; ++e){
+        int src = e - w;
+        float *ge = g + e*len;
+        if(src < 0 || src >= n){
+            for(j = 0; j < len; ++j) ge[j] = -FLT_MAX;
+        } else {
+            memcpy(ge, in + src*stride, len*sizeof(float));
+        }
+        memcpy(h + e*len, ge, len*sizeof(float));
+        if(e % k){
+            float *gp = g + (e-1)*len;
+            for(j = 0; j < len; ++j) ge[j] = MAX(ge[j], gp[j]);
+        }
+    }
+    for(e = m - 2; e >= 0; --e){
+        if(e % k == k - 1) continue;
+        float *he = h + e*len;
+        float *hn = h + (e+1)*len;
+        for(j = 0; j < len; ++j) he[j] = MAX(he[j], hn[j]);
+    }
+    for(i = 0; i < n; ++i){
+        float *hs = h + i*len;
+        float *ge = g + (i + k - 1)*len;
+        float *o = out + i*stride;
+        for(j = 0; j < len; ++j) o[j] = MAX(hs[j], ge[j]);
+    }
+}
+
+// Number of columns processed together in the vertical max pass.
+#define MAX_FILTER_STRIP 64
+
+// Max filter of a 1-channel image, separable and O(1) per pixel.
+// image im: image to filter.
+// int w: window radius, each output is the max over a (2w+1)x(2w+1) window.
+// returns: filtered image, borders only look at pixels inside the image.
+image max_filter_image(image im, int w)
+{
+    image out = make_image(im.w, im.h, 1);
+    image tmp = make_image(im.w, im.h, 1);
+    int longest = MAX(im.w, im.h) + 4*w + 1;
+    float *g = calloc(longest*MAX_FILTER_STRIP, sizeof(float));
+    float *h = calloc(longest*MAX_FILTER_STRIP, sizeof(float));
+    int x, y;
+
+    // Horizontal pass, one row at a time.
+    for(y = 0; y < im.h; ++y){
+        running_max_lines(im.data + y*im.w, tmp.data + y*im.w, im.w, 1, 1, w, g, h);
+    }
+    // Vertical pass, a strip of columns at a time so the inner loop is
+    // contiguous.
+    for(x = 0; x < im.w; x += MAX_FILTER_STRIP){
+        int len = MIN(MAX_FILTER_STRIP, im.w - x);
+        running_max_lines(tmp.data + x, out.data + x, im.h, im.w, len, w, g, h);
+    }
+
+    free(g);
+    free(h);
+    free_image(tmp);
+    return out;
+}
+
 // Perform non-max supression on an image of feature responses.
 // image im: 1-channel image of feature responses.
 // int w: distance to look for larger responses.
@@ -194,74 +439,601 @@ image cornerness_response(image S)
 image nms_image(image im, int w)
 {
     image r = copy_image(im);
-    // TODO: perform NMS on the response map.
-    // for every pixel in the image:
-    //     for neighbors within w:
-    //         if neighbor response greater than pixel response:
-    //             set response to be very low (I use -999999 [why not 0??])
-    int wf = 2*w + 1;
+    image m = max_filter_image(im, w);
+    int i;
+    // Anything smaller than the biggest response in its window gets set
+    // very low (I use -999999 [why not 0??])
+    for(i = 0; i < im.w*im.h; ++i){
+        if(im.data[i] < m.data[i]) r.data[i] = -999999;
+    }
+    free_image(m);
+    return r;
+}
 
-    for(int x = 0; x<im.w; x++) {
-        for(int y = 0; y<im.h; y++) {
-            for(int i = 0; i<wf; i++) {
-                for(int j = 0; j<wf; j++) {
-                    float neighbor = get_pixel(im, x - (w - i), y - (w - j), 0);
-                    float pixel = get_pixel(im, x, y, 0);
-                    if (neighbor > pixel) {
-                        set_pixel(r, x, y, 0, -999999);
+// Finds local maxima of a response map above a threshold.
+// image im: 1-channel image of feature responses.
+// int w: distance to look for larger responses.
+// float thresh: minimum response to keep.
+// int *n: filled with the number of maxima found.
+// returns: pixel indices (x + y*im.w) of the maxima, in row-major order.
+int *nms_indices(image im, int w, float thresh, int *n)
+{
+    image m = max_filter_image(im, w);
+    int i;
+    int count = 0;
+    for(i = 0; i < im.w*im.h; ++i){
+        count += (im.data[i] >= thresh && im.data[i] >= m.data[i]);
+    }
+    int *idx = calloc(count ? count : 1, sizeof(int));
+    count = 0;
+    for(i = 0; i < im.w*im.h; ++i){
+        if(im.data[i] >= thresh && im.data[i] >= m.data[i]) idx[count++] = i;
+    }
+    free_image(m);
+    *n = count;
+    return idx;
+}
+
+// Growable list of keypoints.
+typedef struct{
+    keypoint *data;
+    int n, size;
+} keypoint_list;
+
+static void keypoint_list_add(keypoint_list *l, keypoint k)
+{
+    if(l->n == l->size){
+        l->size = l->size ? 2*l->size : 64;
+        l->data = realloc(l->data, l->size*sizeof(keypoint));
+    }
+    l->data[l->n++] = k;
+}
+
+// Sums all channels of one image row, the gradient filters are linear so
+// this is the same as filtering each channel and summing (what
+// convolve_image does with preserve = 0).
+static void channel_sum_row(image im, int y, float *out)
+{
+    int x, c;
+    memcpy(out, im.data + y*im.w, im.w*sizeof(float));
+    for(c = 1; c < im.c; ++c){
+        float *row = im.data + c*im.w*im.h + y*im.w;
+        for(x = 0; x < im.w; ++x) out[x] += row[x];
+    }
+}
+
+// Scratch buffers for one band of the streaming Harris detector.
+typedef struct{
+    int r, k;          // Gaussian radius and width
+    int kr;            // rows of response kept for NMS
+    int nms;           // NMS radius
+    float *g;          // 1d Gaussian weights
+    float *sum;        // 3 channel-summed image rows, ring
+    int sumtag[3];     // which row each sum slot holds
+    int nc;            // channels blurred, 3 products plus Ix and Iy if orienting
+    float *prod;       // nc padded rows of structure products
+    float *hs;         // k rows x nc channels of horizontally blurred products, ring
+    float *resp;       // kr rows of cornerness, ring
+    float *hmax;       // kr rows of horizontal max of cornerness, ring
+    float *grad;       // kr rows x 2 of blurred Ix and Iy, ring, if orienting
+    float *vsum;       // nc channels of fully blurred products for one row
+    float *mg, *mh;    // scratch for running_max_lines
+} harris_state;
+
+static float *harris_sum_row(image im, harris_state *st, int y)
+{
+    y = MIN(MAX(y, 0), im.h - 1);
+    int slot = y % 3;
+    float *row = st->sum + slot*im.w;
+    if(st->sumtag[slot] != y){
+        channel_sum_row(im, y, row);
+        st->sumtag[slot] = y;
+    }
+    return row;
+}
+
+// Gradients, structure products and the horizontal half of the Gaussian
+// for a single row. Result goes in ring slot y % k.
+static void harris_blur_row(image im, harris_state *st, int y)
+{
+    int w = im.w;
+    int r = st->r;
+    int pw = w + 2*r;
+    float *a = harris_sum_row(im, st, y-1);
+    float *b = harris_sum_row(im, st, y);
+    float *c = harris_sum_row(im, st, y+1);
+    float *pxx = st->prod, *pyy = st->prod + pw, *pxy = st->prod + 2*pw;
+    float *px = st->prod + 3*pw, *py = st->prod + 4*pw;
+    int x, i, ch;
+    for(x = 0; x < w; ++x){
+        int l = MAX(x-1, 0);
+        int rt = MIN(x+1, w-1);
+        float ix = (a[rt] - a[l]) + 2*(b[rt] - b[l]) + (c[rt] - c[l]);
+        float iy = (c[l] - a[l]) + 2*(c[x] - a[x]) + (c[rt] - a[rt]);
+        pxx[x + r] = ix*ix;
+        pyy[x + r] = iy*iy;
+        pxy[x + r] = ix*iy;
+        if(st->nc == 5){
+            px[x + r] = ix;
+            py[x + r] = iy;
+        }
+    }
+    // Replicate the edges so the blur doesn't need to clamp.
+    for(ch = 0; ch < st->nc; ++ch){
+        float *p = st->prod + ch*pw;
+        for(i = 0; i < r; ++i){
+            p[i] = p[r];
+            p[r + w + i] = p[r + w - 1];
+        }
+    }
+    float *out = st->hs + (y % st->k)*st->nc*w;
+    for(x = 0; x < w; ++x){
+        float sxx = 0, syy = 0, sxy = 0;
+        for(i = 0; i < st->k; ++i){
+            sxx += st->g[i]*pxx[x + i];
+            syy += st->g[i]*pyy[x + i];
+            sxy += st->g[i]*pxy[x + i];
+        }
+        out[x] = sxx;
+        out[w + x] = syy;
+        out[2*w + x] = sxy;
+    }
+    if(st->nc == 5){
+        for(x = 0; x < w; ++x){
+            float sx = 0, sy = 0;
+            for(i = 0; i < st->k; ++i){
+                sx += st->g[i]*px[x + i];
+                sy += st->g[i]*py[x + i];
+            }
+            out[3*w + x] = sx;
+            out[4*w + x] = sy;
+        }
+    }
+}
+
+// Vertical half of the Gaussian plus the cornerness for row y, then the
+// horizontal max of that row for NMS. Results go in ring slot y % kr.
+static void harris_response_row(image im, harris_state *st, int y)
+{
+    int w = im.w;
+    int x, j;
+    float *resp = st->resp + (y % st->kr)*w;
+    float *sxy = st->vsum;
+    int cw = st->nc*w;
+    memset(sxy, 0, cw*sizeof(float));
+    for(j = 0; j < st->k; ++j){
+        int q = MIN(MAX(y + j - st->r, 0), im.h - 1);
+        float *row = st->hs + (q % st->k)*cw;
+        float gj = st->g[j];
+        for(x = 0; x < cw; ++x) sxy[x] += gj*row[x];
+    }
+    if(st->nc == 5) memcpy(st->grad + (y % st->kr)*2*w, sxy + 3*w, 2*w*sizeof(float));
+    for(x = 0; x < w; ++x){
+        float a = sxy[x], d = sxy[w + x], b = sxy[2*w + x];
+        float det = a*d - b*b;
+        float trace = a + d;
+        resp[x] = det - 0.06 * trace * trace;
+    }
+    running_max_lines(resp, st->hmax + (y % st->kr)*w, w, 1, 1, st->nms, st->mg, st->mh);
+}
+
+// Offset of the peak of the parabola through three evenly spaced samples.
+// float l, c, r: samples at -1, 0 and 1, c should be the largest.
+// returns: offset of the peak from the center sample, in [-.5, .5].
+static float quadratic_peak(float l, float c, float r)
+{
+    float curve = l - 2*c + r;
+    if(curve >= 0) return 0;
+    float d = .5f*(l - r)/curve;
+    return MIN(MAX(d, -.5f), .5f);
+}
+
+// Runs the streaming detector over output rows [y0, y1).
+static void harris_band(image im, harris_params p, int y0, int y1, keypoint_list *out)
+{
+    harris_state st = {0};
+    float sigma = p.sigma;
+    int nms = p.nms;
+    int w = im.w;
+    int x, y, j;
+
+    st.k = (int)ceil(sigma * 6);
+    if(st.k % 2 == 0) ++st.k;
+    st.r = st.k/2;
+    st.g = calloc(st.k, sizeof(float));
+    float total = 0;
+    for(j = 0; j < st.k; ++j){
+        int d = j - st.r;
+        st.g[j] = exp(-(d*d)/(2 * sigma * sigma));
+        total += st.g[j];
+    }
+    for(j = 0; j < st.k; ++j) st.g[j] /= total;
+
+    st.nms = nms;
+    st.kr = MAX(2*nms + 1, 3);
+    st.sum = calloc(3*w, sizeof(float));
+    st.sumtag[0] = st.sumtag[1] = st.sumtag[2] = -1;
+    st.nc = p.oriented ? 5 : 3;
+    st.prod = calloc(st.nc*(w + 2*st.r), sizeof(float));
+    st.hs = calloc(st.k*st.nc*w, sizeof(float));
+    st.resp = calloc(st.kr*w, sizeof(float));
+    st.hmax = calloc(st.kr*w, sizeof(float));
+    if(p.oriented) st.grad = calloc(st.kr*2*w, sizeof(float));
+    st.vsum = calloc(st.nc*w, sizeof(float));
+    st.mg = calloc(w + 4*st.kr + 1, sizeof(float));
+    st.mh = calloc(w + 4*st.kr + 1, sizeof(float));
+    float *vmax = calloc(w, sizeof(float));
+
+    // Rows are emitted once the row below is resident too, so the
+    // sub-pixel fit can read its neighbors straight out of the ring.
+    int look = MAX(nms, 1);
+    int rfirst = MAX(0, y0 - look);
+    int rlast = MIN(im.h - 1, y1 - 1 + look);
+    int hnext = MAX(0, rfirst - st.r);
+    int next = y0;
+    for(y = rfirst; y <= rlast; ++y){
+        int need = MIN(im.h - 1, y + st.r);
+        while(hnext <= need) harris_blur_row(im, &st, hnext++);
+        harris_response_row(im, &st, y);
+
+        // Every row whose NMS window is now complete gets its maxima.
+        while(next < y1 && (next + look <= y || y == im.h - 1)){
+            int lo = MAX(0, next - nms), hi = MIN(im.h - 1, next + nms);
+            memcpy(vmax, st.hmax + (lo % st.kr)*w, w*sizeof(float));
+            for(j = lo + 1; j <= hi; ++j){
+                float *row = st.hmax + (j % st.kr)*w;
+                for(x = 0; x < w; ++x) vmax[x] = MAX(vmax[x], row[x]);
+            }
+            float *resp = st.resp + (next % st.kr)*w;
+            float *up = (next > 0) ? st.resp + ((next - 1) % st.kr)*w : 0;
+            float *down = (next < im.h - 1) ? st.resp + ((next + 1) % st.kr)*w : 0;
+            float *gx = p.oriented ? st.grad + (next % st.kr)*2*w : 0;
+            for(x = 0; x < w; ++x){
+                if(resp[x] >= p.thresh && resp[x] >= vmax[x]){
+                    keypoint k;
+                    k.p = make_point(x, next);
+                    k.response = resp[x];
+                    k.octave = 0;
+                    // Direction of the Gaussian weighted mean gradient.
+                    k.angle = gx ? atan2f(gx[w + x], gx[x]) : 0;
+                    if(p.subpixel){
+                        if(x > 0 && x < w - 1) k.p.x += quadratic_peak(resp[x-1], resp[x], resp[x+1]);
+                        if(up && down) k.p.y += quadratic_peak(up[x], resp[x], down[x]);
                     }
+                    keypoint_list_add(out, k);
                 }
             }
+            ++next;
         }
     }
-    return r;
+
+    free(vmax);
+    free(st.g); free(st.sum); free(st.prod); free(st.hs);
+    free(st.resp); free(st.hmax); free(st.grad); free(st.vsum); free(st.mg); free(st.mh);
 }
 
-// Perform harris corner detection and extract features from the corners.
+// Detects Harris corners in one streaming pass over the image.
+// Gradients, structure products, the separable Gaussian, cornerness and
+// NMS are computed a row at a time through small ring buffers, so memory
+// is a few rows regardless of image height and nothing full-size is ever
+// written. Horizontal bands are processed in parallel with OPENMP=1.
 // image im: input image.
+// harris_params p: detection options, uses sigma, thresh, nms, subpixel
+//                  and oriented.
+// int *n: filled with number of keypoints.
+// returns: keypoints in row-major order.
+keypoint *harris_keypoints(image im, harris_params p, int *n)
+{
+    int bands = 1;
+#ifdef _OPENMP
+    bands = omp_get_max_threads();
+#endif
+    bands = MAX(1, MIN(bands, im.h/64));
+    keypoint_list *lists = calloc(bands, sizeof(keypoint_list));
+    int b;
+    #pragma omp parallel for
+    for(b = 0; b < bands; ++b){
+        int y0 = (long)im.h*b/bands;
+        int y1 = (long)im.h*(b+1)/bands;
+        harris_band(im, p, y0, y1, &lists[b]);
+    }
+
+    int count = 0;
+    for(b = 0; b < bands; ++b) count += lists[b].n;
+    keypoint *kp = calloc(count ? count : 1, sizeof(keypoint));
+    count = 0;
+    for(b = 0; b < bands; ++b){
+        if(lists[b].n) memcpy(kp + count, lists[b].data, lists[b].n*sizeof(keypoint));
+        count += lists[b].n;
+        free(lists[b].data);
+    }
+    free(lists);
+    *n = count;
+    return kp;
+}
+
+// Moves the k strongest keypoints to the front of the array.
+// Quickselect on response, linear time on average.
+// keypoint *kp: keypoints to rearrange.
+// int n: number of keypoints.
+// int k: how many of the strongest to bring to the front.
+static void select_strongest(keypoint *kp, int n, int k)
+{
+    int lo = 0, hi = n - 1;
+    if(k <= 0 || k >= n) return;
+    while(lo < hi){
+        // Median of three pivot, descending order.
+        int mid = lo + (hi - lo)/2;
+        float a = kp[lo].response, b = kp[mid].response, c = kp[hi].response;
+        float pivot = (a > b) ? ((b > c) ? b : (a > c ? c : a)) : ((a > c) ? a : (b > c ? c : b));
+        int i = lo, j = hi;
+        while(i <= j){
+            while(kp[i].response > pivot) ++i;
+            while(kp[j].response < pivot) --j;
+            if(i <= j){
+                keypoint t = kp[i]; kp[i] = kp[j]; kp[j] = t;
+                ++i; --j;
+            }
+        }
+        if(k - 1 <= j) hi = j;
+        else if(k - 1 >= i) lo = i;
+        else break;
+    }
+}
+
+// Keeps only the strongest keypoints, optionally spread over a grid so
+// corners don't all pile up in the most textured part of the image.
+// keypoint *kp: keypoints, rearranged in place.
+// int n: number of keypoints.
+// int max: maximum number of keypoints to keep, 0 keeps everything.
+// int grid: split the image into grid x grid cells and keep up to
+//           max/(grid*grid) per cell, then fill the rest of max with the
+//           strongest of what's left. 0 or 1 selects over the whole image.
+// int w, h: size of the image the keypoints came from.
+// returns: number of keypoints kept, at most max, they are at the front of kp.
+int select_keypoints(keypoint *kp, int n, int max, int grid, int w, int h)
+{
+    if(max <= 0 || n <= max) return n;
+    if(grid <= 1){
+        select_strongest(kp, n, max);
+        return max;
+    }
+
+    // Counting sort into cells, then select within each cell.
+    int cells = grid*grid;
+    int per = max/cells;
+    int *start = calloc(cells + 1, sizeof(int));
+    int *cell = calloc(n, sizeof(int));
+    keypoint *sorted = calloc(n, sizeof(keypoint));
+    int i, c;
+    for(i = 0; i < n; ++i){
+        int cx = MIN(grid - 1, (int)(kp[i].p.x*grid/w));
+        int cy = MIN(grid - 1, (int)(kp[i].p.y*grid/h));
+        cell[i] = cy*grid + cx;
+        ++start[cell[i] + 1];
+    }
+    for(c = 0; c < cells; ++c) start[c + 1] += start[c];
+    int *fill = calloc(cells, sizeof(int));
+    for(i = 0; i < n; ++i) sorted[start[cell[i]] + fill[cell[i]]++] = kp[i];
+
+    // Each cell's share goes to the front, everything it didn't keep
+    // follows as leftovers.
+    int count = 0;
+    for(c = 0; c < cells; ++c){
+        int cn = start[c + 1] - start[c];
+        fill[c] = MIN(cn, per);
+        select_strongest(sorted + start[c], cn, fill[c]);
+        memcpy(kp + count, sorted + start[c], fill[c]*sizeof(keypoint));
+        count += fill[c];
+    }
+    int left = count;
+    for(c = 0; c < cells; ++c){
+        int rest = start[c + 1] - start[c] - fill[c];
+        memcpy(kp + left, sorted + start[c] + fill[c], rest*sizeof(keypoint));
+        left += rest;
+    }
+    // Whatever max/cells didn't hand out goes to the strongest leftovers.
+    select_strongest(kp + count, n - count, max - count);
+    count = max;
+    free(start);
+    free(cell);
+    free(fill);
+    free(sorted);
+    return count;
+}
+
+// Default feature detection options, matching harris_corner_detector.
 // float sigma: std. dev for harris.
 // float thresh: threshold for cornerness.
 // int nms: distance to look for local-maxes in response map.
-// int *n: pointer to number of corners detected, should fill in.
-// returns: array of descriptors of the corners in the image.
-descriptor *harris_corner_detector(image im, float sigma, float thresh, int nms, int *n)
+// returns: options with sub-pixel refinement on and every other extra
+//          stage turned off.
+harris_params make_harris_params(float sigma, float thresh, int nms)
 {
-    // Calculate structure matrix
-    image S = structure_matrix(im, sigma);
+    harris_params p = {0};
+    p.sigma = sigma;
+    p.thresh = thresh;
+    p.nms = nms;
+    p.subpixel = 1;
+    return p;
+}
 
-    // Estimate cornerness
-    image R = cornerness_response(S);
+// Drops keypoints that have a stronger keypoint from another octave
+// nearby, so each corner is kept at the scale where it responds most.
+// Responses have to be scale normalized, see pyramid_keypoints.
+// keypoint *kp: keypoints in base image coordinates, compacted in place.
+// int n: number of keypoints.
+// int r: suppression radius at octave 0, doubles every octave.
+// int octaves: number of octaves the keypoints came from.
+// int w, h: size of the base image.
+// returns: number of keypoints kept, in their original order.
+static int cross_scale_nms(keypoint *kp, int n, int r, int octaves, int w, int h)
+{
+    // Buckets as wide as the largest radius, so neighbors are at most one
+    // cell away.
+    int cell = r << (octaves - 1);
+    int gw = w/cell + 1, gh = h/cell + 1;
+    int *start = calloc(gw*gh + 1, sizeof(int));
+    int *order = calloc(n, sizeof(int));
+    int *fill = calloc(gw*gh, sizeof(int));
+    char *dead = calloc(n, sizeof(char));
+    int i, j;
+    for(i = 0; i < n; ++i){
+        int c = MIN((int)kp[i].p.y/cell, gh - 1)*gw + MIN((int)kp[i].p.x/cell, gw - 1);
+        ++start[c + 1];
+    }
+    for(i = 0; i < gw*gh; ++i) start[i + 1] += start[i];
+    for(i = 0; i < n; ++i){
+        int c = MIN((int)kp[i].p.y/cell, gh - 1)*gw + MIN((int)kp[i].p.x/cell, gw - 1);
+        order[start[c] + fill[c]++] = i;
+    }
 
-    // Run NMS on the responses
-    image Rnms = nms_image(R, nms);
+    #pragma omp parallel for private(j)
+    for(i = 0; i < n; ++i){
+        int cx = MIN((int)kp[i].p.x/cell, gw - 1);
+        int cy = MIN((int)kp[i].p.y/cell, gh - 1);
+        int gx, gy;
+        for(gy = MAX(cy - 1, 0); gy <= MIN(cy + 1, gh - 1) && !dead[i]; ++gy){
+            for(gx = MAX(cx - 1, 0); gx <= MIN(cx + 1, gw - 1) && !dead[i]; ++gx){
+                int c = gy*gw + gx;
+                for(j = start[c]; j < start[c + 1]; ++j){
+                    keypoint *o = &kp[order[j]];
+                    if(o->octave == kp[i].octave) continue;
+                    float d = r << MAX(o->octave, kp[i].octave);
+                    if(fabs(o->p.x - kp[i].p.x) > d || fabs(o->p.y - kp[i].p.y) > d) continue;
+                    if(o->response > kp[i].response ||
+                       (o->response == kp[i].response && order[j] < i)){
+                        dead[i] = 1;
+                        break;
+                    }
+                }
+            }
+        }
+    }
 
+    int count = 0;
+    for(i = 0; i < n; ++i) if(!dead[i]) kp[count++] = kp[i];
+    free(start);
+    free(order);
+    free(fill);
+    free(dead);
+    return count;
+}
 
-    //TODO: count number of responses over threshold
-    int count = 0; // change this
-    for(int i = 0; i<Rnms.w*Rnms.h; i++) {
-        if (Rnms.data[i] >= thresh) {
-            count++;
+// Runs the Harris detector on every level of a pyramid, all octaves at
+// once with OPENMP=1.
+// Gradients at octave o are 2^o times steeper per pixel than the same
+// edge at full size, and cornerness goes as gradient^4, so responses are
+// divided by 2^(4o) to put every octave in full size units. The threshold
+// is scaled to match, so it means the same thing at every level.
+// pyramid pyr: levels to search.
+// harris_params p: detection options, nms is applied within each octave.
+// int *n: filled with number of keypoints.
+// returns: keypoints in base image coordinates, tagged with their octave.
+static keypoint *pyramid_keypoints(pyramid pyr, harris_params p, int *n)
+{
+    keypoint **lists = calloc(pyr.n, sizeof(keypoint *));
+    int *counts = calloc(pyr.n, sizeof(int));
+    int o, i;
+    #pragma omp parallel for private(i)
+    for(o = 0; o < pyr.n; ++o){
+        harris_params lp = p;
+        lp.thresh = ldexpf(p.thresh, 4*o);
+        lists[o] = harris_keypoints(pyr.levels[o], lp, &counts[o]);
+        for(i = 0; i < counts[o]; ++i){
+            lists[o][i].p.x *= 1 << o;
+            lists[o][i].p.y *= 1 << o;
+            lists[o][i].response = ldexpf(lists[o][i].response, -4*o);
+            lists[o][i].octave = o;
         }
     }
+    int count = 0;
+    for(o = 0; o < pyr.n; ++o) count += counts[o];
+    keypoint *kp = calloc(count ? count : 1, sizeof(keypoint));
+    count = 0;
+    for(o = 0; o < pyr.n; ++o){
+        memcpy(kp + count, lists[o], counts[o]*sizeof(keypoint));
+        count += counts[o];
+        free(lists[o]);
+    }
+    free(lists);
+    free(counts);
+    *n = count;
+    return kp;
+}
+
+// Detect features and describe them.
+// image im: input image.
+// harris_params p: detection options.
+// int *n: pointer to number of corners detected, filled in.
+// returns: array of descriptors of the corners in the image.
+descriptor *detect_features(image im, harris_params p, int *n)
+{
+    descriptor *cached = feature_cache_lookup(im, p, n);
+    if(cached) return cached;
+
+    int count = 0;
+    keypoint *kp;
+    pyramid pyr = {0};
+    if(p.octaves > 1){
+        // One pyramid for detection and description, descriptors are cut
+        // from the octave each corner was found in.
+        pyr = make_pyramid(im, p.octaves);
+        kp = pyramid_keypoints(pyr, p, &count);
+        count = cross_scale_nms(kp, count, MAX(p.nms, 1), pyr.n, im.w, im.h);
+    } else {
+        // Structure matrix, cornerness and NMS in one streaming pass
+        kp = harris_keypoints(im, p, &count);
+        pyr.levels = &im;
+        pyr.n = 1;
+    }
+    count = select_keypoints(kp, count, p.max_corners, p.grid, im.w, im.h);
 
-    
-    *n = count; // <- set *n equal to number of corners in image.
+    *n = count;
     descriptor *d = calloc(count, sizeof(descriptor));
-    //TODO: fill in array *d with descriptors of corners, use describe_index.
-    int idx = 0;
-    for(int i = 0; i<Rnms.w*Rnms.h; i++) {
-        if (Rnms.data[i] >= thresh) {
-            d[idx++] = describe_index(im, i);
+    int i;
+    // Build the pattern tables before any parallel caller can race on them.
+    if(p.binary && !brief_ready) make_brief_pattern();
+    if(p.oriented && !patch_ready) make_patch_pattern();
+    if(p.binary){
+        image *smooth = calloc(pyr.n, sizeof(image));
+        for(i = 0; i < pyr.n; ++i) smooth[i] = brief_smooth_image(pyr.levels[i]);
+        for(i = 0; i < count; ++i){
+            float s = 1 << kp[i].octave;
+            d[i] = describe_binary(smooth[kp[i].octave], roundf(kp[i].p.x/s), roundf(kp[i].p.y/s), kp[i].angle);
+            d[i].p = kp[i].p;
+        }
+        for(i = 0; i < pyr.n; ++i) free_image(smooth[i]);
+        free(smooth);
+    } else {
+        for(i = 0; i < count; ++i){
+            image l = pyr.levels[kp[i].octave];
+            float s = 1 << kp[i].octave;
+            int x = MIN((int)roundf(kp[i].p.x/s), l.w - 1);
+            int y = MIN((int)roundf(kp[i].p.y/s), l.h - 1);
+            d[i] = p.oriented ? describe_oriented(l, x, y, kp[i].angle) : describe_index(l, x + l.w*y);
+            d[i].p = kp[i].p;
         }
     }
 
-
-    free_image(S);
-    free_image(R);
-    free_image(Rnms);
+    if(p.octaves > 1) free_pyramid(pyr);
+    free(kp);
+    feature_cache_store(im, p, d, count);
     return d;
 }
 
+// Perform harris corner detection and extract features from the corners.
+// image im: input image.
+// float sigma: std. dev for harris.
+// float thresh: threshold for cornerness.
+// int nms: distance to look for local-maxes in response map.
+// int *n: pointer to number of corners detected, should fill in.
+// returns: array of descriptors of the corners in the image.
+descriptor *harris_corner_detector(image im, float sigma, float thresh, int nms, int *n)
+{
+    return detect_features(im, make_harris_params(sigma, thresh, nms), n);
+}
+
 // Find and draw corners on an image.
 // image im: input image.
 // float sigma: std. dev for harris.
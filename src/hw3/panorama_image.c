@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <math.h>
+#include <float.h>
 #include <assert.h>
 #include "image.h"
 #include "matrix.h"
@@ -126,103 +127,194 @@ float l1_distance(float *a, float *b, int n)
     return distance;
 }
 
-// Finds best matches between descriptors of two images.
+static int hamming_words(unsigned long long *a, unsigned long long *b, int words)
+{
+    int i;
+    int distance = 0;
+    for(i = 0; i < words; ++i) distance += __builtin_popcountll(a[i] ^ b[i]);
+    return distance;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Same loop built with the popcnt instruction. Without -mpopcnt the
+// builtin above becomes a libgcc call per word.
+__attribute__((target("popcnt")))
+static int hamming_words_popcnt(unsigned long long *a, unsigned long long *b, int words)
+{
+    int i;
+    int distance = 0;
+    for(i = 0; i < words; ++i) distance += __builtin_popcountll(a[i] ^ b[i]);
+    return distance;
+}
+#endif
+
+// Counts differing bits between two binary descriptors.
+// unsigned long long *a, *b: descriptor bits.
+// int n: number of bits in each descriptor, a multiple of 64.
+// returns: hamming distance between the descriptors.
+float hamming_distance(unsigned long long *a, unsigned long long *b, int n)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    if(__builtin_cpu_supports("popcnt")) return hamming_words_popcnt(a, b, n/64);
+#endif
+    return hamming_words(a, b, n/64);
+}
+
+// Distance between two descriptors of the same kind.
+// descriptor *a, *b: descriptors to compare.
+// returns: hamming distance for binary descriptors, l1 distance otherwise.
+static float descriptor_distance(descriptor *a, descriptor *b)
+{
+    if(a->bits) return hamming_distance(a->bits, b->bits, a->n);
+    return l1_distance(a->data, b->data, a->n);
+}
+
+// Finds the nearest descriptor in b for every descriptor in a and, when
+// asked, the nearest descriptor in a for every descriptor in b.
 // descriptor *a, *b: array of descriptors for pixels in two images.
 // int an, bn: number of descriptors in arrays a and b.
-// int *mn: pointer to number of matches found, to be filled in by function.
-// returns: best matches found. each descriptor in a should match with at most
-//          one other descriptor in b.
-match *match_descriptors(descriptor *a, int an, descriptor *b, int bn, int *mn)
+// int *best_a: if not 0, filled with the index in a closest to each b.
+// returns: one match per descriptor in a, in the order of a.
+static match *nearest_matches(descriptor *a, int an, descriptor *b, int bn, int *best_a)
 {
-    int i,j;
-
-    // We will have at most an matches.
-    *mn = an;
     match *m = calloc(an, sizeof(match));
-    for(j = 0; j < an; ++j){
-        // TODO: for every descriptor in a, find best match in b.
-        // record ai as the index in *a and bi as the index in *b.
-        int bind = 0; // <- find the best match
-        float closest = 0;
-        for(i = 0; i<bn; i++) {
-            float distance = l1_distance(a[j].data, b[i].data, a[j].n);
-            if (closest > distance || i == 0) {
-                bind = i;
-                closest = distance;
-            }
+    float *best_a_dist = 0;
+    if(best_a){
+        best_a_dist = calloc(bn, sizeof(float));
+        int i;
+        for(i = 0; i < bn; ++i){
+            best_a[i] = -1;
+            best_a_dist[i] = FLT_MAX;
         }
-        
-        m[j].ai = j;
-        m[j].bi = bind; // <- should be index in b.
-        m[j].p = a[j].p;
-        m[j].q = b[bind].p;
-        m[j].distance = closest; // <- should be the smallest L1 distance!
     }
 
-    int count = 0;
-    int *seen = calloc(bn, sizeof(int));
-    // TODO: we want matches to be injective (one-to-one).
-    // Sort matches based on distance using match_compare and qsort.
-    // Then throw out matches to the same element in b. Use seen to keep track.
-    // Each point should only be a part of one match.
-    // Some points will not be in a match.
-    // In practice just bring good matches to front of list, set *mn.
-    qsort(m, an, sizeof(match), match_compare);
-    int top = an;
-    int found = 0;
-    for(i = 0; i<top; i++) {
-        // check if m[i].bi exists in seen
-        found = 0;
-        for(j = 0; j<count; j++) {
-            if(seen[j] == m[i].bi) {
-                found = 1;
-                break;
+    #pragma omp parallel
+    {
+        // Each thread keeps its own nearest-a table and merges it at the end.
+        int *local = 0;
+        float *local_dist = 0;
+        int i, j;
+        if(best_a){
+            local = calloc(bn, sizeof(int));
+            local_dist = calloc(bn, sizeof(float));
+            for(i = 0; i < bn; ++i){
+                local[i] = -1;
+                local_dist[i] = FLT_MAX;
             }
         }
-        if (found == 1) {
-            // this data has been seen, throw it out
-            // shift all other elements
-            for(int k = i; k<an-1; k++) {
-                m[k] = m[k+1];
+
+        #pragma omp for
+        for(j = 0; j < an; ++j){
+            int bind = 0;
+            float closest = 0;
+            for(i = 0; i < bn; ++i){
+                float distance = descriptor_distance(&a[j], &b[i]);
+                if(closest > distance || i == 0){
+                    bind = i;
+                    closest = distance;
+                }
+                // j only increases within a thread, so strict < keeps the
+                // smallest index on ties, same as the serial scan.
+                if(local && distance < local_dist[i]){
+                    local[i] = j;
+                    local_dist[i] = distance;
+                }
             }
-            i--;
-            top--;
-        } else {
-            seen[count++] = m[i].bi;
+            m[j].ai = j;
+            m[j].bi = bind;
+            m[j].p = a[j].p;
+            m[j].q = b[bind].p;
+            m[j].distance = closest;
+        }
+
+        if(local){
+            #pragma omp critical
+            for(i = 0; i < bn; ++i){
+                if(local[i] < 0) continue;
+                if(local_dist[i] < best_a_dist[i] ||
+                   (local_dist[i] == best_a_dist[i] && local[i] < best_a[i])){
+                    best_a[i] = local[i];
+                    best_a_dist[i] = local_dist[i];
+                }
+            }
+            free(local);
+            free(local_dist);
         }
+    }
+    free(best_a_dist);
+    return m;
+}
 
+// Sorts matches by distance and keeps the first match to each element of b.
+// match *m: matches to filter, compacted in place.
+// int n: number of matches in m.
+// int bn: number of descriptors in b.
+// int *best_a: if not 0, also drop matches that aren't mutual nearest neighbors.
+// returns: number of matches kept at the front of m.
+static int filter_matches(match *m, int n, int bn, int *best_a)
+{
+    int i;
+    int count = 0;
+    char *seen = calloc(bn, sizeof(char));
+    qsort(m, n, sizeof(match), match_compare);
+    for(i = 0; i < n; ++i){
+        int bi = m[i].bi;
+        if(seen[bi]) continue;
+        if(best_a && best_a[bi] != m[i].ai) continue;
+        seen[bi] = 1;
+        m[count++] = m[i];
     }
-    *mn = count;
     free(seen);
+    return count;
+}
+
+// Finds best matches between descriptors of two images.
+// descriptor *a, *b: array of descriptors for pixels in two images.
+// int an, bn: number of descriptors in arrays a and b.
+// int *mn: pointer to number of matches found, to be filled in by function.
+// returns: best matches found. each descriptor in a should match with at most
+//          one other descriptor in b.
+match *match_descriptors(descriptor *a, int an, descriptor *b, int bn, int *mn)
+{
+    match *m = nearest_matches(a, an, b, bn, 0);
+    *mn = filter_matches(m, an, bn, 0);
+    return m;
+}
+
+// Finds mutual nearest neighbor matches between descriptors of two images:
+// a[i] and b[j] only match if each is the other's closest descriptor.
+// descriptor *a, *b: array of descriptors for pixels in two images.
+// int an, bn: number of descriptors in arrays a and b.
+// int *mn: pointer to number of matches found, to be filled in by function.
+// returns: matches found, sorted by distance.
+match *match_descriptors_mutual(descriptor *a, int an, descriptor *b, int bn, int *mn)
+{
+    int *best_a = calloc(bn, sizeof(int));
+    match *m = nearest_matches(a, an, b, bn, best_a);
+    *mn = filter_matches(m, an, bn, best_a);
+    free(best_a);
     return m;
 }
 
+// Apply a projective transformation to a point.
+// mat3 H: homography to project point.
+// point p: point to project.
+// returns: point projected using the homography.
+point project_point_mat3(mat3 H, point p)
+{
+    double x = H.m[0][0]*p.x + H.m[0][1]*p.y + H.m[0][2];
+    double y = H.m[1][0]*p.x + H.m[1][1]*p.y + H.m[1][2];
+    double w = H.m[2][0]*p.x + H.m[2][1]*p.y + H.m[2][2];
+    return make_point(x/w, y/w);
+}
+
 // Apply a projective transformation to a point.
 // matrix H: homography to project point.
 // point p: point to project.
 // returns: point projected using the homography.
 point project_point(matrix H, point p)
 {
-    matrix c = make_matrix(3, 1);
-    // TODO: project point p with homography H.
-    // Remember that homogeneous coordinates are equivalent up to scalar.
-    // Have to divide by.... something...
-
-    // create augmented vector from point p
-    c.data[0][0] = p.x;
-    c.data[1][0] = p.y;
-    c.data[2][0] = 1;
-
-    point q = make_point(0, 0);
-    
-    matrix x_bar_prime = matrix_mult_matrix(H, c);
-
-    float w = x_bar_prime.data[2][0];
-
-    q.x = x_bar_prime.data[0][0] / w;
-    q.y = x_bar_prime.data[1][0] / w;
-
-    return q;
+    return project_point_mat3(mat3_from_matrix(H), p);
 }
 
 // Calculate L2 distance between two points.
@@ -236,14 +328,14 @@ float point_distance(point p, point q)
 
 // Count number of inliers in a set of matches. Should also bring inliers
 // to the front of the array.
-// matrix H: homography between coordinate systems.
+// mat3 H: homography between coordinate systems.
 // match *m: matches to compute inlier/outlier.
 // int n: number of matches in m.
 // float thresh: threshold to be an inlier.
 // returns: number of inliers whose projected point falls within thresh of
 //          their match in the other image. Should also rearrange matches
 //          so that the inliers are first in the array. For drawing.
-int model_inliers(matrix H, match *m, int n, float thresh)
+int model_inliers_mat3(mat3 H, match *m, int n, float thresh)
 {
     int i;
     int count = 0;
@@ -254,7 +346,7 @@ int model_inliers(matrix H, match *m, int n, float thresh)
     // Also, sort the matches m so the inliers are the first 'count' elements.
     match temp;
     for(i = 0; i<n; i++) {
-        p = project_point(H, m[i].p);
+        p = project_point_mat3(H, m[i].p);
         distance = point_distance(p, m[i].q);
         m[i].distance = distance;
         if (distance < thresh) {
@@ -273,6 +365,17 @@ int model_inliers(matrix H, match *m, int n, float thresh)
     return count;
 }
 
+// Count number of inliers in a set of matches, see model_inliers_mat3.
+// matrix H: homography between coordinate systems.
+// match *m: matches to compute inlier/outlier.
+// int n: number of matches in m.
+// float thresh: threshold to be an inlier.
+// returns: number of inliers, which are moved to the front of m.
+int model_inliers(matrix H, match *m, int n, float thresh)
+{
+    return model_inliers_mat3(mat3_from_matrix(H), m, n, thresh);
+}
+
 // Randomly shuffle matches for RANSAC.
 // match *m: matches to shuffle in place.
 // int n: number of elements in matches.
@@ -291,64 +394,135 @@ void randomize_matches(match *m, int n)
     }
 }
 
+// Finds the similarity transform that moves a point set to its centroid
+// with an average distance of sqrt(2) from the origin (Hartley).
+// match *m: matches holding the points.
+// int n: number of matches.
+// int useq: normalize the q points instead of the p points.
+// double T[3]: filled with scale, x offset, y offset.
+// returns: 1 on success, 0 if all points coincide.
+static int hartley_normalize(match *m, int n, int useq, double T[3])
+{
+    int i;
+    double cx = 0, cy = 0, d = 0;
+    for(i = 0; i < n; ++i){
+        point p = useq ? m[i].q : m[i].p;
+        cx += p.x;
+        cy += p.y;
+    }
+    cx /= n;
+    cy /= n;
+    for(i = 0; i < n; ++i){
+        point p = useq ? m[i].q : m[i].p;
+        d += sqrt((p.x - cx)*(p.x - cx) + (p.y - cy)*(p.y - cy));
+    }
+    d /= n;
+    if(d < 1e-12) return 0;
+    T[0] = sqrt(2.)/d;
+    T[1] = -T[0]*cx;
+    T[2] = -T[0]*cy;
+    return 1;
+}
+
+// Solves the symmetric positive definite 8x8 system A x = b with Cholesky.
+// returns: 1 on success, 0 if A is not positive definite.
+static int solve8_cholesky(mat8 A, double b[8], double x[8])
+{
+    mat8 L = mat8_zero();
+    double y[8];
+    int i, j, k;
+    for(j = 0; j < 8; ++j){
+        double d = A.m[j][j];
+        for(k = 0; k < j; ++k) d -= L.m[j][k]*L.m[j][k];
+        if(d <= 1e-12) return 0;
+        L.m[j][j] = sqrt(d);
+        for(i = j+1; i < 8; ++i){
+            double v = A.m[i][j];
+            for(k = 0; k < j; ++k) v -= L.m[i][k]*L.m[j][k];
+            L.m[i][j] = v/L.m[j][j];
+        }
+    }
+    for(i = 0; i < 8; ++i){
+        double v = b[i];
+        for(k = 0; k < i; ++k) v -= L.m[i][k]*y[k];
+        y[i] = v/L.m[i][i];
+    }
+    for(i = 7; i >= 0; --i){
+        double v = y[i];
+        for(k = i+1; k < 8; ++k) v -= L.m[k][i]*x[k];
+        x[i] = v/L.m[i][i];
+    }
+    return 1;
+}
+
+// Solves for the homography between matched points without touching the heap.
+// Points are Hartley-normalized first. Exactly 4 matches are solved directly,
+// more are solved in the least squares sense through the 8x8 normal equations.
+// match *matches: matching points between images.
+// int n: number of matches to use, at least 4.
+// mat3 *H: filled with the homography, H->m[2][2] = 1.
+// returns: 1 on success, 0 if the points are degenerate.
+int solve_homography(match *matches, int n, mat3 *H)
+{
+    if(n < 4) return 0;
+    double Tp[3], Tq[3];
+    if(!hartley_normalize(matches, n, 0, Tp)) return 0;
+    if(!hartley_normalize(matches, n, 1, Tq)) return 0;
+
+    mat8 A = mat8_zero();
+    double b[8] = {0};
+    double h[8];
+    int i, j, k;
+    for(i = 0; i < n; ++i){
+        double x  = Tp[0]*matches[i].p.x + Tp[1];
+        double y  = Tp[0]*matches[i].p.y + Tp[2];
+        double xp = Tq[0]*matches[i].q.x + Tq[1];
+        double yp = Tq[0]*matches[i].q.y + Tq[2];
+        double r0[8] = {x, y, 1, 0, 0, 0, -x*xp, -y*xp};
+        double r1[8] = {0, 0, 0, x, y, 1, -x*yp, -y*yp};
+        if(n == 4){
+            memcpy(A.m[2*i], r0, sizeof(r0));
+            memcpy(A.m[2*i+1], r1, sizeof(r1));
+            b[2*i] = xp;
+            b[2*i+1] = yp;
+        } else {
+            for(j = 0; j < 8; ++j){
+                for(k = j; k < 8; ++k) A.m[j][k] += r0[j]*r0[k] + r1[j]*r1[k];
+                b[j] += r0[j]*xp + r1[j]*yp;
+            }
+        }
+    }
+    if(n == 4){
+        if(!mat8_solve(A, b, h)) return 0;
+    } else {
+        for(j = 0; j < 8; ++j) for(k = 0; k < j; ++k) A.m[j][k] = A.m[k][j];
+        if(!solve8_cholesky(A, b, h)) return 0;
+    }
+
+    // Undo the normalization: H = Tq^-1 * Hn * Tp.
+    mat3 Hn = {{{h[0], h[1], h[2]}, {h[3], h[4], h[5]}, {h[6], h[7], 1}}};
+    mat3 P = {{{Tp[0], 0, Tp[1]}, {0, Tp[0], Tp[2]}, {0, 0, 1}}};
+    mat3 Qi = {{{1/Tq[0], 0, -Tq[1]/Tq[0]}, {0, 1/Tq[0], -Tq[2]/Tq[0]}, {0, 0, 1}}};
+    mat3 R = mat3_mult(Qi, mat3_mult(Hn, P));
+    if(fabs(R.m[2][2]) < 1e-12) return 0;
+    double s = R.m[2][2];
+    for(i = 0; i < 3; ++i) for(j = 0; j < 3; ++j) R.m[i][j] /= s;
+    R.m[2][2] = 1;
+    *H = R;
+    return 1;
+}
+
 // Computes homography between two images given matching pixels.
 // match *matches: matching points between images.
 // int n: number of matches to use in calculating homography.
 // returns: matrix representing homography H that maps image a to image b.
 matrix compute_homography(match *matches, int n)
 {
-    matrix M = make_matrix(n*2, 8);
-    matrix b = make_matrix(n*2, 1);
-
-    int i;
-    for(i = 0; i < n; ++i){
-        double x  = matches[i].p.x;
-        double xp = matches[i].q.x;
-        double y  = matches[i].p.y;
-        double yp = matches[i].q.y;
-        // TODO: fill in the matrices M and b.
-        b.data[2*i][0] = xp;
-        b.data[2*i + 1][0] = yp;
-
-        M.data[2*i][0] = x;
-        M.data[2*i][1] = y;
-        M.data[2*i][2] = 1;
-        M.data[2*i][3] = 0;
-        M.data[2*i][4] = 0;
-        M.data[2*i][5] = 0;
-        M.data[2*i][6] = -1 * x * xp;
-        M.data[2*i][7] = -1 * xp * y;
-
-        M.data[2*i + 1][0] = 0;
-        M.data[2*i + 1][1] = 0;
-        M.data[2*i + 1][2] = 0;
-        M.data[2*i + 1][3] = x;
-        M.data[2*i + 1][4] = y;
-        M.data[2*i + 1][5] = 1;
-        M.data[2*i + 1][6] = -1 * x * yp;
-        M.data[2*i + 1][7] = -1 * y * yp;
-    }
-    matrix a = solve_system(M, b);
-    free_matrix(M); free_matrix(b); 
-
     // If a solution can't be found, return empty matrix;
     matrix none = {0};
-    if(!a.data) return none;
-
-    matrix H = make_matrix(3, 3);
-    // TODO: fill in the homography H based on the result in a.
-    H.data[0][0] = a.data[0][0];
-    H.data[0][1] = a.data[1][0];
-    H.data[0][2] = a.data[2][0];
-    H.data[1][0] = a.data[3][0];
-    H.data[1][1] = a.data[4][0];
-    H.data[1][2] = a.data[5][0];
-    H.data[2][0] = a.data[6][0];
-    H.data[2][1] = a.data[7][0];
-    H.data[2][2] = 1;
-
-    free_matrix(a);
-    return H;
+    mat3 H;
+    if(!solve_homography(matches, n, &H)) return none;
+    return mat3_to_matrix(H);
 }
 
 // Perform RANdom SAmple Consensus to calculate homography for noisy matches.
@@ -362,7 +536,7 @@ matrix RANSAC(match *m, int n, float thresh, int k, int cutoff)
 {
     int e;
     int best = 0;
-    matrix Hb = make_translation_homography(256, 0);
+    mat3 Hb = mat3_translation(256, 0);
     // TODO: fill in RANSAC algorithm.
     // for k iterations:
     //     shuffle the matches
@@ -376,34 +550,46 @@ matrix RANSAC(match *m, int n, float thresh, int k, int cutoff)
     
     int min = 4;
     int count = 0;
-    matrix H;
+    mat3 H;
     for(e = 0; e<k; e++) {
         randomize_matches(m, n);
-        H = compute_homography(m, min);
-        count = model_inliers(H, m, n, thresh);
+        if (!solve_homography(m, min, &H)) continue;
+        count = model_inliers_mat3(H, m, n, thresh);
 
         if (count > best) {
-            Hb = compute_homography(m, count);
+            if (!solve_homography(m, count, &Hb)) Hb = H;
             best = count;
-            if (count > cutoff) return Hb;
+            if (count > cutoff) break;
         }
     };
-    return Hb;
+    return mat3_to_matrix(Hb);
 }
 
-// Stitches two images together using a projective transformation.
+// Canvas layout for stitching image b onto image a.
+// int dx, dy: offset of the canvas origin in image a coordinates.
+// int w, h: size of the canvas.
+// point bmin, bmax: bounding box of image b warped onto the canvas.
+typedef struct{
+    int dx, dy;
+    int w, h;
+    point bmin, bmax;
+} canvas;
+
+// Works out how big the stitched image has to be.
 // image a, b: images to stitch.
 // matrix H: homography from image a coordinates to image b coordinates.
-// returns: combined image stitched together.
-image combine_images(image a, image b, matrix H)
+// returns: canvas layout, w = 0 if H can't be inverted.
+canvas panorama_canvas(image a, image b, matrix H)
 {
-    matrix Hinv = matrix_invert(H);
+    canvas cv = {0};
+    mat3 Hinv;
+    if(!mat3_invert(mat3_from_matrix(H), &Hinv)) return cv;
 
     // Project the corners of image b into image a coordinates.
-    point c1 = project_point(Hinv, make_point(0,0));
-    point c2 = project_point(Hinv, make_point(b.w-1, 0));
-    point c3 = project_point(Hinv, make_point(0, b.h-1));
-    point c4 = project_point(Hinv, make_point(b.w-1, b.h-1));
+    point c1 = project_point_mat3(Hinv, make_point(0,0));
+    point c2 = project_point_mat3(Hinv, make_point(b.w-1, 0));
+    point c3 = project_point_mat3(Hinv, make_point(0, b.h-1));
+    point c4 = project_point_mat3(Hinv, make_point(b.w-1, b.h-1));
 
     // Find top left and bottom right corners of image b warped into image a.
     point topleft, botright;
@@ -413,72 +599,163 @@ image combine_images(image a, image b, matrix H)
     topleft.y = MIN(c1.y, MIN(c2.y, MIN(c3.y, c4.y)));
 
     // Find how big our new image should be and the offsets from image a.
-    int dx = MIN(0, topleft.x);
-    int dy = MIN(0, topleft.y);
-    int w = MAX(a.w, botright.x) - dx;
-    int h = MAX(a.h, botright.y) - dy;
+    cv.dx = MIN(0, topleft.x);
+    cv.dy = MIN(0, topleft.y);
+    cv.w = MAX(a.w, botright.x) - cv.dx;
+    cv.h = MAX(a.h, botright.y) - cv.dy;
+    cv.bmin = make_point(topleft.x - cv.dx, topleft.y - cv.dy);
+    cv.bmax = make_point(botright.x - cv.dx, botright.y - cv.dy);
+    return cv;
+}
+
+// Renders one rectangle of the stitched canvas.
+// image a, b: images to stitch.
+// matrix H: homography from image a coordinates to image b coordinates.
+// canvas cv: canvas layout from panorama_canvas.
+// image out: destination, covers canvas pixels [x0, x0+out.w) x [y0, y0+out.h).
+// int x0, y0: canvas coordinates of the top left corner of out.
+void render_panorama_region(image a, image b, matrix H, canvas cv, image out, int x0, int y0)
+{
+    int i, j, k;
+    int plane = out.w*out.h;
+
+    // Paste the part of image a that lands in this region.
+    int ax0 = MAX(0, x0 + cv.dx);
+    int ay0 = MAX(0, y0 + cv.dy);
+    int ax1 = MIN(a.w, x0 + cv.dx + out.w);
+    int ay1 = MIN(a.h, y0 + cv.dy + out.h);
+    for(k = 0; k < out.c && k < a.c; ++k){
+        for(j = ay0; j < ay1; ++j){
+            for(i = ax0; i < ax1; ++i){
+                out.data[k*plane + (j - cv.dy - y0)*out.w + (i - cv.dx - x0)] = a.data[k*a.w*a.h + j*a.w + i];
+            }
+        }
+    }
+
+    // Only look at image b where its warped bounding box overlaps the region.
+    int bx0 = MAX(x0, (int)floorf(cv.bmin.x));
+    int by0 = MAX(y0, (int)floorf(cv.bmin.y));
+    int bx1 = MIN(x0 + out.w, (int)ceilf(cv.bmax.x) + 1);
+    int by1 = MIN(y0 + out.h, (int)ceilf(cv.bmax.y) + 1);
+    if(bx0 >= bx1 || by0 >= by1) return;
+
+    // Canvas coordinates to image a coordinates, then on to image b.
+    mat3 hh = mat3_mult(mat3_from_matrix(H), mat3_translation(cv.dx, cv.dy));
+    for(j = by0; j < by1; ++j){
+        for(i = bx0; i < bx1; ++i){
+            point p = project_point_mat3(hh, make_point(i, j));
+            if (p.x >= 0 && p.x < b.w && p.y >= 0 && p.y < b.h) {
+                for(k = 0; k < out.c && k < b.c; ++k){
+                    out.data[k*plane + (j - y0)*out.w + (i - x0)] = bilinear_interpolate(b, p.x, p.y, k);
+                }
+            }
+        }
+    }
+}
+
+// Stitches two images together using a projective transformation.
+// image a, b: images to stitch.
+// matrix H: homography from image a coordinates to image b coordinates.
+// returns: combined image stitched together.
+image combine_images(image a, image b, matrix H)
+{
+    canvas cv = panorama_canvas(a, b, H);
 
     // Can disable this if you are making very big panoramas.
     // Usually this means there was an error in calculating H.
-    if(w > 7000 || h > 7000){
-        printf("Output target: (%d, %d)", w, h);
+    // Use combine_images_tiled for canvases that don't fit in memory.
+    if(cv.w > 7000 || cv.h > 7000){
+        printf("Output target: (%d, %d)", cv.w, cv.h);
         fprintf(stderr, "output too big, stopping\n");
         return copy_image(a);
     }
 
-    int i,j,k;
-    image c = make_image(w, h, a.c);
-    
-    // Paste image a into the new image offset by dx and dy.
-    for(k = 0; k < a.c; ++k){
-        for(j = 0; j < a.h; ++j){
-            for(i = 0; i < a.w; ++i){
-                // TODO: fill in.
-                set_pixel(c, i - dx, j - dy, k, get_pixel(a, i, j, k));
-            }
+    image c = make_image(cv.w, cv.h, a.c);
+    render_panorama_region(a, b, H, cv, c, 0, 0);
+    return c;
+}
+
+// Stitches two images together, streaming the canvas to disk tile by tile.
+// Only one tile is held in memory at a time. The file is a header of
+// 5 ints (magic, w, h, c, tile) followed by every tile in row-major order,
+// each tile x tile x c floats, planar, edge tiles padded with zeros.
+// image a, b: images to stitch.
+// matrix H: homography from image a coordinates to image b coordinates.
+// const char *fname: file to write.
+// int tile: tile size in pixels.
+// returns: 1 on success, 0 on failure.
+int combine_images_tiled(image a, image b, matrix H, const char *fname, int tile)
+{
+    canvas cv = panorama_canvas(a, b, H);
+    if(cv.w <= 0 || cv.h <= 0 || tile <= 0) return 0;
+
+    FILE *fp = fopen(fname, "wb");
+    if(!fp){
+        fprintf(stderr, "Couldn't open file %s\n", fname);
+        return 0;
+    }
+    int header[5] = {TILED_IMAGE_MAGIC, cv.w, cv.h, a.c, tile};
+    fwrite(header, sizeof(int), 5, fp);
+
+    image t = make_image(tile, tile, a.c);
+    int tx, ty;
+    int ok = 1;
+    for(ty = 0; ty < cv.h && ok; ty += tile){
+        for(tx = 0; tx < cv.w && ok; tx += tile){
+            memset(t.data, 0, tile*tile*t.c*sizeof(float));
+            render_panorama_region(a, b, H, cv, t, tx, ty);
+            ok = fwrite(t.data, sizeof(float), tile*tile*t.c, fp) == (size_t)(tile*tile*t.c);
         }
     }
+    free_image(t);
+    fclose(fp);
+    if(!ok) fprintf(stderr, "Failed to write tiles to %s\n", fname);
+    return ok;
+}
 
-    // TODO: Paste in image b as well.
-    // You should loop over some points in the new image (which? all?)
-    // and see if their projection from a coordinates to b coordinates falls
-    // inside of the bounds of image b. If so, use bilinear interpolation to
-    // estimate the value of b at that projection, then fill in image c.
+// Reads one tile back out of a file written by combine_images_tiled.
+// const char *fname: tiled image file.
+// int tx, ty: column and row of the tile.
+// returns: the tile, cropped at the canvas edges. Empty image on failure.
+image load_image_tile(const char *fname, int tx, int ty)
+{
+    image none = {0};
+    int header[5] = {0};
+    FILE *fp = fopen(fname, "rb");
+    if(!fp) return none;
+    if(fread(header, sizeof(int), 5, fp) != 5 || header[0] != TILED_IMAGE_MAGIC){
+        fclose(fp);
+        return none;
+    }
+    int w = header[1], h = header[2], c = header[3], tile = header[4];
+    int across = (w + tile - 1)/tile;
+    int down = (h + tile - 1)/tile;
+    if(tx < 0 || ty < 0 || tx >= across || ty >= down){
+        fclose(fp);
+        return none;
+    }
 
-    // create matrix translation
-    matrix ht = make_translation_homography(dx, dy);
-    // apply the translation to homography matrix
+    image t = make_image(tile, tile, c);
+    long offset = 5*sizeof(int) + (long)(ty*across + tx)*tile*tile*c*sizeof(float);
+    fseek(fp, offset, SEEK_SET);
+    size_t got = fread(t.data, sizeof(float), tile*tile*c, fp);
+    fclose(fp);
+    if(got != (size_t)(tile*tile*c)){
+        free_image(t);
+        return none;
+    }
 
-    matrix hh = matrix_mult_matrix(H, ht);
-    point p;
-    float x, y, z;
-    for(i = 0; i<c.w; i++) {
-        for(j = 0; j<c.h; j++) {
-            // project point from image a to b
-            p = project_point(hh, make_point(i, j));
-            // if the projected point is valid, copy that pixel
-            if (p.x >= 0 && p.x < b.w && p.y >= 0 && p.y < b.h) {
-                // use bilinear interpolation to interpolate the pixel
-                x = bilinear_interpolate(b, p.x, p.y, 0);
-                y = bilinear_interpolate(b, p.x, p.y, 1);
-                z = bilinear_interpolate(b, p.x, p.y, 2);
-
-                // if (c1 == 0 && c2 == 0 && c3 == 0) {
-                //     continue;
-                // }
-                set_pixel(c, i, j, 0, x);
-                set_pixel(c, i, j, 1, y);
-                set_pixel(c, i, j, 2, z);
-                // for(k = 0; k<c.c; ++k) {
-                    
-
-                //     set_pixel(c, i, j, k, );
-                // }
+    image out = make_image(MIN(tile, w - tx*tile), MIN(tile, h - ty*tile), c);
+    int i, j, k;
+    for(k = 0; k < c; ++k){
+        for(j = 0; j < out.h; ++j){
+            for(i = 0; i < out.w; ++i){
+                out.data[k*out.w*out.h + j*out.w + i] = t.data[k*tile*tile + j*tile + i];
             }
         }
     }
-
-    return c;
+    free_image(t);
+    return out;
 }
 
 // Create a panoramam between two images.
@@ -490,6 +767,18 @@ image combine_images(image a, image b, matrix H)
 // int iters: number of RANSAC iterations. Typical: 1,000-50,000
 // int cutoff: RANSAC inlier cutoff. Typical: 10-100
 image panorama_image(image a, image b, float sigma, float thresh, int nms, float inlier_thresh, int iters, int cutoff)
+{
+    harris_params p = make_harris_params(sigma, thresh, nms);
+    return panorama_image_params(a, b, p, inlier_thresh, iters, cutoff);
+}
+
+// Create a panorama between two images with full control over detection.
+// image a, b: images to stitch together.
+// harris_params p: feature detection options, see make_harris_params.
+// float inlier_thresh: threshold for RANSAC inliers. Typical: 2-5
+// int iters: number of RANSAC iterations. Typical: 1,000-50,000
+// int cutoff: RANSAC inlier cutoff. Typical: 10-100
+image panorama_image_params(image a, image b, harris_params p, float inlier_thresh, int iters, int cutoff)
 {
     srand(10);
     int an = 0;
@@ -497,8 +786,8 @@ image panorama_image(image a, image b, float sigma, float thresh, int nms, float
     int mn = 0;
     
     // Calculate corners and descriptors
-    descriptor *ad = harris_corner_detector(a, sigma, thresh, nms, &an);
-    descriptor *bd = harris_corner_detector(b, sigma, thresh, nms, &bn);
+    descriptor *ad = detect_features(a, p, &an);
+    descriptor *bd = detect_features(b, p, &bn);
 
     // Find matches
     match *m = match_descriptors(ad, an, bd, bn, &mn);
@@ -520,6 +809,7 @@ image panorama_image(image a, image b, float sigma, float thresh, int nms, float
 
     // Stitch the images together with the homography
     image comb = combine_images(a, b, H);
+    free_matrix(H);
     return comb;
 }
 
@@ -557,62 +847,16 @@ point project_spherical(point p, float xc, float yc, float f)
 // returns: image projected onto cylinder, then flattened.
 image cylindrical_project(image im, float f)
 {
-    //TODO: project image onto a cylinder
-    int xc = im.w / 2;
-    int yc = im.h / 2;
-
-    point p = project_cylinder(make_point(0, 0), xc, yc, f);
-    point q = project_cylinder(make_point(xc, 0), xc, yc, f);
-    float dx = p.x;
-    float dy = q.y;
-
-    image c = make_image(im.w + (int)(dx*2) + (int)(dy*2), im.h, im.c);
-    
-    int i, j, k;
-    float v;
-
-    for(i = 0; i<im.w; i++) {
-        for(j = 0; j<im.h; j++) {
-            p = project_cylinder(make_point(i, j), xc, yc, f);
-            for(k = 0; k<im.c; k++) {
-                v = 0;
-                // if (p.x >= 0 && p.x < im.w && p.y >= 0 && p.y < im.h) {
-                    v = nn_interpolate(im, p.x, p.y, k);
-                // }
-                set_pixel(c, i + (int)dx, j + (int)dy, k, v);
-            }
-        }
-    }
-    return c;
+    remap r = get_projection_remap(im.w, im.h, f, CYLINDRICAL);
+    return apply_remap(im, r);
 }
 
+// Project an image onto a sphere.
+// image im: image to project.
+// float f: focal length used to take image (in pixels).
+// returns: image projected onto sphere, then flattened.
 image spherical_project(image im, float f)
 {
-    int xc = im.w / 2;
-    int yc = im.h / 2;
-
-    point p = project_spherical(make_point(0, 0), xc, yc, f);
-    point q = project_spherical(make_point(xc, 0), xc, yc, f);
-    float dx = p.x;
-    float dy = q.y;
-
-    image c = make_image(im.w + (int)(dx*2) + (int)(dy*2), im.h, im.c);
-    
-    int i, j, k;
-    float v;
-    
-    for(int i = 0; i<im.w; i++) {
-        for(int j = 0; j<im.h; j++) {
-            p = project_spherical(make_point(i, j), xc, yc, f);
-
-            for(int k = 0; k<im.c; k++) {
-                float v = 0;
-                // if (x >= 0 && x < im.w && y >= 0 && y < im.h) {
-                    v = nn_interpolate(im, p.x, p.y, k);
-                // }
-                set_pixel(c, i, j, k, v);
-            }
-        }
-    }
-    return c;
+    remap r = get_projection_remap(im.w, im.h, f, SPHERICAL);
+    return apply_remap(im, r);
 }
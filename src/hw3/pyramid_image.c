@@ -0,0 +1,75 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "image.h"
+
+// Smallest side a pyramid level is allowed to have.
+#define PYRAMID_MIN_SIZE 16
+
+// Blurs with the 5 tap binomial [1 4 6 4 1]/16 and drops every other
+// pixel, in both directions. Pixel (x, y) of the result sits at (2x, 2y)
+// in the source.
+// image im: image to shrink.
+// returns: image of size (w+1)/2 x (h+1)/2.
+image pyramid_down(image im)
+{
+    int w = (im.w + 1)/2;
+    int h = (im.h + 1)/2;
+    image out = make_image(w, h, im.c);
+    int c;
+    #pragma omp parallel for
+    for(c = 0; c < im.c; ++c){
+        float *src = im.data + c*im.w*im.h;
+        float *dst = out.data + c*w*h;
+        float *rows = calloc(5*w, sizeof(float));
+        int x, y, k;
+        for(y = 0; y < h; ++y){
+            // Horizontal pass on the 5 source rows around 2y.
+            for(k = 0; k < 5; ++k){
+                int sy = MIN(MAX(2*y + k - 2, 0), im.h - 1);
+                float *in = src + sy*im.w;
+                float *r = rows + k*w;
+                for(x = 0; x < w; ++x){
+                    int x0 = MAX(2*x - 2, 0), x1 = MAX(2*x - 1, 0);
+                    int x3 = MIN(2*x + 1, im.w - 1), x4 = MIN(2*x + 2, im.w - 1);
+                    r[x] = (in[x0] + 4*in[x1] + 6*in[2*x] + 4*in[x3] + in[x4])*(1.f/16);
+                }
+            }
+            float *o = dst + y*w;
+            for(x = 0; x < w; ++x){
+                o[x] = (rows[x] + 4*rows[w + x] + 6*rows[2*w + x] + 4*rows[3*w + x] + rows[4*w + x])*(1.f/16);
+            }
+        }
+        free(rows);
+    }
+    return out;
+}
+
+// Builds a Gaussian pyramid, each level half the size of the one before.
+// image im: base of the pyramid, copied into level 0.
+// int levels: number of levels wanted, fewer are made if the image gets
+//             smaller than PYRAMID_MIN_SIZE.
+// returns: the pyramid, free with free_pyramid.
+pyramid make_pyramid(image im, int levels)
+{
+    pyramid p;
+    p.levels = calloc(MAX(levels, 1), sizeof(image));
+    p.levels[0] = copy_image(im);
+    p.n = 1;
+    while(p.n < levels){
+        image prev = p.levels[p.n - 1];
+        if((prev.w + 1)/2 < PYRAMID_MIN_SIZE || (prev.h + 1)/2 < PYRAMID_MIN_SIZE) break;
+        p.levels[p.n++] = pyramid_down(prev);
+    }
+    return p;
+}
+
+// Frees every level of a pyramid.
+// pyramid p: pyramid to free.
+void free_pyramid(pyramid p)
+{
+    int i;
+    for(i = 0; i < p.n; ++i) free_image(p.levels[i]);
+    free(p.levels);
+}
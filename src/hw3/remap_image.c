@@ -0,0 +1,158 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "image.h"
+
+// Number of remap tables kept around by get_projection_remap.
+#define REMAP_CACHE_SIZE 4
+
+typedef struct{
+    int w, h;
+    float f;
+    PROJECTION p;
+    remap r;
+} remap_entry;
+
+static remap_entry remap_cache[REMAP_CACHE_SIZE];
+static int remap_cache_next = 0;
+
+// Frees a remap table.
+// remap r: table to free.
+void free_remap(remap r)
+{
+    free(r.x);
+    free(r.y);
+}
+
+// Projects a single output pixel into the source image.
+// float x, y: output pixel.
+// float xc, yc: optical center of the source image.
+// float f: focal length in pixels.
+// PROJECTION p: which surface to project onto.
+// returns: location to sample in the source image.
+static point project_surface(float x, float y, float xc, float yc, float f, PROJECTION p)
+{
+    if(p == SPHERICAL) return project_spherical(make_point(x, y), xc, yc, f);
+    return project_cylinder(make_point(x, y), xc, yc, f);
+}
+
+// Builds the lookup table for projecting a w x h image onto a surface.
+// int w, h: size of the source image.
+// float f: focal length used to take image (in pixels).
+// PROJECTION p: CYLINDRICAL or SPHERICAL.
+// returns: table holding, for every output pixel, where to sample the source.
+remap make_projection_remap(int w, int h, float f, PROJECTION p)
+{
+    int xc = w / 2;
+    int yc = h / 2;
+
+    // Same canvas as the direct projection: shrink horizontally by the
+    // amount the edges of the image get pulled in.
+    point tl = project_surface(0, 0, xc, yc, f, p);
+    point tc = project_surface(xc, 0, xc, yc, f, p);
+    int dx = (int)tl.x;
+    int dy = (int)tc.y;
+
+    remap r;
+    r.sw = w;
+    r.sh = h;
+    r.w = w + 2*dx + 2*dy;
+    r.h = h;
+    r.x = calloc(r.w*r.h, sizeof(float));
+    r.y = calloc(r.w*r.h, sizeof(float));
+
+    // Cylindrical output is centered on the canvas, spherical is not.
+    int ox = (p == CYLINDRICAL) ? dx : 0;
+    int oy = (p == CYLINDRICAL) ? dy : 0;
+
+    int i, j;
+    #pragma omp parallel for private(i)
+    for(j = 0; j < r.h; ++j){
+        for(i = 0; i < r.w; ++i){
+            point q = project_surface(i - ox, j - oy, xc, yc, f, p);
+            r.x[i + j*r.w] = q.x;
+            r.y[i + j*r.w] = q.y;
+        }
+    }
+    return r;
+}
+
+// Gets a projection table, building it only if it isn't cached already.
+// int w, h: size of the source image.
+// float f: focal length used to take image (in pixels).
+// PROJECTION p: CYLINDRICAL or SPHERICAL.
+// returns: cached table, owned by the cache. Do not free it.
+remap get_projection_remap(int w, int h, float f, PROJECTION p)
+{
+    int i;
+    for(i = 0; i < REMAP_CACHE_SIZE; ++i){
+        remap_entry e = remap_cache[i];
+        if(e.r.x && e.w == w && e.h == h && e.f == f && e.p == p) return e.r;
+    }
+    remap_entry *e = &remap_cache[remap_cache_next];
+    remap_cache_next = (remap_cache_next + 1) % REMAP_CACHE_SIZE;
+    if(e->r.x) free_remap(e->r);
+    e->w = w;
+    e->h = h;
+    e->f = f;
+    e->p = p;
+    e->r = make_projection_remap(w, h, f, p);
+    return e->r;
+}
+
+// Drops every cached projection table.
+void clear_remap_cache()
+{
+    int i;
+    for(i = 0; i < REMAP_CACHE_SIZE; ++i){
+        if(remap_cache[i].r.x) free_remap(remap_cache[i].r);
+    }
+    memset(remap_cache, 0, sizeof(remap_cache));
+    remap_cache_next = 0;
+}
+
+// Resamples an image through a lookup table using bilinear interpolation.
+// image im: source image, must be the size the table was built for.
+// remap r: table of sample locations.
+// returns: image of size r.w x r.h.
+image apply_remap(image im, remap r)
+{
+    if(im.w != r.sw || im.h != r.sh){
+        fprintf(stderr, "remap built for %d x %d, got %d x %d\n", r.sw, r.sh, im.w, im.h);
+        return copy_image(im);
+    }
+    image out = make_image(r.w, r.h, im.c);
+    int plane = im.w*im.h;
+    int i, j, k;
+    #pragma omp parallel for private(i, k)
+    for(j = 0; j < r.h; ++j){
+        for(i = 0; i < r.w; ++i){
+            int o = i + j*r.w;
+            float x = r.x[o];
+            float y = r.y[o];
+            int x0 = (int)floorf(x);
+            int y0 = (int)floorf(y);
+            float fx = x - x0;
+            float fy = y - y0;
+            int x1 = MIN(MAX(x0 + 1, 0), im.w - 1);
+            int y1 = MIN(MAX(y0 + 1, 0), im.h - 1);
+            x0 = MIN(MAX(x0, 0), im.w - 1);
+            y0 = MIN(MAX(y0, 0), im.h - 1);
+
+            int i00 = x0 + y0*im.w;
+            int i10 = x1 + y0*im.w;
+            int i01 = x0 + y1*im.w;
+            int i11 = x1 + y1*im.w;
+            float w00 = (1-fx)*(1-fy);
+            float w10 = fx*(1-fy);
+            float w01 = (1-fx)*fy;
+            float w11 = fx*fy;
+            for(k = 0; k < im.c; ++k){
+                float *src = im.data + k*plane;
+                out.data[o + k*r.w*r.h] = w00*src[i00] + w10*src[i10] + w01*src[i01] + w11*src[i11];
+            }
+        }
+    }
+    return out;
+}
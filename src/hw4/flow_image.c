@@ -141,7 +141,7 @@ image time_structure_matrix(image im, image prev, int s)
 
     // TODO: calculate gradients, structure components, and smooth them
 
-    image S = make_image(im.w, im.h, 5);
+    image S = make_image_uninit(im.w, im.h, 5);
 
     image x_filter = make_gx_filter();
     image y_filter = make_gy_filter();
@@ -162,12 +162,17 @@ image time_structure_matrix(image im, image prev, int s)
         }
     }
 
-    S = box_filter_image(S, s);
+    image smoothed = box_filter_image(S, s);
 
+    free_image(x_filter);
+    free_image(y_filter);
+    free_image(im_x);
+    free_image(im_y);
+    free_image(S);
     if(converted){
         free_image(im); free_image(prev);
     }
-    return S;
+    return smoothed;
 }
 
 // Calculate the velocity given a structure image
@@ -177,7 +182,6 @@ image velocity_image(image S, int stride)
 {
     image v = make_image(S.w/stride, S.h/stride, 3);
     int i, j;
-    matrix M = make_matrix(2,2);
     for(j = (stride-1)/2; j < S.h; j += stride){
         for(i = (stride-1)/2; i < S.w; i += stride){
             float Ixx = S.data[i + S.w*j + 0*S.w*S.h];
@@ -187,33 +191,20 @@ image velocity_image(image S, int stride)
             float Iyt = S.data[i + S.w*j + 4*S.w*S.h];
 
             // TODO: calculate vx and vy using the flow equation
-            float vx = 0;
-            float vy = 0;
-            
-            // calculate determinant to check if the matrix can be inverted
-            float d = (Ixx * Iyy) - (Ixy * Ixy);
-            if (d != 0) {
-                // M.data[0][0] = Ixx;
-                // M.data[0][1] = Ixy;
-                // M.data[1][0] = Ixy;
-                // M.data[1][1] = Iyy;
-                // matrix invert = matrix_invert(M);
-                // matrix invert = make_matrix(2, 2);
-                M.data[0][0] = Iyy / d;
-                M.data[0][1] = -Ixy / d;
-                M.data[1][0] = -Ixy / d;
-                M.data[1][1] = Ixx / d;
+            double vel[2] = {0, 0};
 
-                vx = (M.data[0][0] * -Ixt) + (M.data[0][1] * -Iyt);
-                vy = (M.data[1][0] * -Ixt) + (M.data[1][1] * -Iyt);
-            } 
-            
+            // v = -M^-1 * [Ixt, Iyt], skipped where M can't be inverted
+            mat2 M = {{{Ixx, Ixy}, {Ixy, Iyy}}};
+            mat2 Minv;
+            if (mat2_invert(M, &Minv)) {
+                double t[2] = {-Ixt, -Iyt};
+                mat2_mult_vector(Minv, t, vel);
+            }
 
-            set_pixel(v, i/stride, j/stride, 0, vx);
-            set_pixel(v, i/stride, j/stride, 1, vy);
+            set_pixel(v, i/stride, j/stride, 0, vel[0]);
+            set_pixel(v, i/stride, j/stride, 1, vel[1]);
         }
     }
-    free_matrix(M);
     return v;
 }
 
@@ -275,6 +266,8 @@ void optical_flow_webcam(int smooth, int stride, int div)
 #ifdef OPENCV
     void * cap;
     cap = open_video_stream(0, 0, 1280, 720, 30);
+    // Every frame makes the same temporaries, recycle them.
+    push_scratch_scope();
     image prev = get_image_from_stream(cap);
     image prev_c = nn_resize(prev, prev.w/div, prev.h/div);
     image im = get_image_from_stream(cap);
@@ -298,6 +291,7 @@ void optical_flow_webcam(int smooth, int stride, int div)
         im = get_image_from_stream(cap);
         im_c = nn_resize(im, im.w/div, im.h/div);
     }
+    pop_scratch_scope();
 #else
     fprintf(stderr, "Must compile with OpenCV\n");
 #endif
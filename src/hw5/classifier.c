@@ -258,6 +258,8 @@ double cross_entropy_loss(matrix y, matrix p)
 void train_model(model m, data d, int batch, int iters, double rate, double momentum, double decay)
 {
     int e;
+    // Each iteration makes and frees the same matrices, keep them pooled.
+    push_scratch_scope();
     for(e = 0; e < iters; ++e){
         data b = random_batch(d, batch);
         matrix p = forward_model(m, b.X);
@@ -268,6 +270,7 @@ void train_model(model m, data d, int batch, int iters, double rate, double mome
         free_matrix(dL);
         free_data(b);
     }
+    pop_scratch_scope();
 }
 
 
@@ -3,6 +3,8 @@
 #include <stdio.h>
 
 #include "matrix.h"
+#include "small_matrix.h"
+#include "scratch.h"
 #define TWOPI 6.2831853
 
 #define MIN(a,b) (((a)<(b))?(a):(b))
@@ -21,20 +23,80 @@ typedef struct{
     float *data;
 } image;
 
+typedef enum{LAYOUT_PLANAR, LAYOUT_INTERLEAVED} IMAGE_LAYOUT;
+
+// An 8 bit image, 0 to 255 for 0 to 1.
+// IMAGE_LAYOUT layout: LAYOUT_PLANAR stores channels one after another
+//                      like image, LAYOUT_INTERLEAVED stores RGBRGB... like
+//                      stb and OpenCV buffers.
+typedef struct{
+    int w,h,c;
+    unsigned char *data;
+    IMAGE_LAYOUT layout;
+} image_u8;
+
 // A 2d point.
 // float x, y: the coordinates of the point.
 typedef struct{
     float x, y;
 } point;
 
+// A detected feature point.
+// point p: x,y coordinates of the feature.
+// float response: cornerness at the feature.
+// int octave: pyramid level the feature was found in, 0 is full size.
+// float angle: direction of the mean gradient around the feature, radians.
+typedef struct{
+    point p;
+    float response;
+    int octave;
+    float angle;
+} keypoint;
+
+// A Gaussian image pyramid.
+// int n: number of levels.
+// image *levels: level 0 is full size, each one after is half the last.
+typedef struct{
+    int n;
+    image *levels;
+} pyramid;
+
+// Options for feature detection, start from make_harris_params.
+// float sigma: std. dev for harris.
+// float thresh: threshold for cornerness.
+// int nms: distance to look for local-maxes in response map.
+// int max_corners: keep at most this many of the strongest corners, 0 keeps all.
+// int grid: spread max_corners evenly over grid x grid cells, 0 for global.
+// int binary: use BRIEF_BITS binary descriptors matched by hamming distance.
+// int subpixel: refine corner locations to sub-pixel accuracy.
+// int octaves: search this many pyramid levels, 0 or 1 for full size only.
+// int oriented: rotate descriptors to each corner's gradient direction.
+typedef struct{
+    float sigma;
+    float thresh;
+    int nms;
+    int max_corners;
+    int grid;
+    int binary;
+    int subpixel;
+    int octaves;
+    int oriented;
+} harris_params;
+
+// Number of bits in a binary descriptor.
+#define BRIEF_BITS 256
+
 // A descriptor for a point in an image.
 // point p: x,y coordinates of the image pixel.
-// int n: the number of floating point values in the descriptor.
-// float *data: the descriptor for the pixel.
+// int n: the number of floating point values in the descriptor,
+//        or the number of bits for binary descriptors.
+// float *data: the descriptor for the pixel, 0 for binary descriptors.
+// unsigned long long *bits: binary descriptor, 0 for float descriptors.
 typedef struct{
     point p;
     int n;
     float *data;
+    unsigned long long *bits;
 } descriptor;
 
 // A match between two points in an image.
@@ -47,6 +109,63 @@ typedef struct{
     float distance;
 } match;
 
+// Magic number and version at the start of files written by
+// save_image_binary and the other raw image writers.
+#define RAW_IMAGE_MAGIC 0x49525755
+#define RAW_IMAGE_VERSION 1
+
+typedef enum{RAW_F32, RAW_U8} RAW_DTYPE;
+
+// Streams a raw image file to disk, see open_image_writer.
+typedef struct image_writer image_writer;
+
+// A save running in the background, see save_image_async.
+typedef struct save_job save_job;
+
+// Magic number at the start of files written by combine_images_tiled.
+#define TILED_IMAGE_MAGIC 0x4c545755
+
+typedef enum{CYLINDRICAL, SPHERICAL} PROJECTION;
+
+typedef enum{RESAMPLE_NEAREST, RESAMPLE_BILINEAR, RESAMPLE_BICUBIC, RESAMPLE_LANCZOS, RESAMPLE_AREA} RESAMPLE_FILTER;
+
+typedef enum{COLOR_RGB, COLOR_LINEAR_RGB, COLOR_XYZ, COLOR_LAB, COLOR_YCBCR, COLOR_GRAY} COLORSPACE;
+
+typedef enum{CURVE_NONE, CURVE_SRGB_DECODE, CURVE_SRGB_ENCODE, CURVE_LAB_F, CURVE_LAB_FINV} COLOR_CURVE;
+
+// One step of a color conversion: v' = post(m * pre(v) + bias).
+// COLOR_CURVE pre, post: per channel curves before and after the matrix.
+// float m[3][3]: matrix applied to the three channels.
+// float bias[3]: added after the matrix.
+typedef struct{
+    COLOR_CURVE pre;
+    float m[3][3];
+    float bias[3];
+    COLOR_CURVE post;
+} color_stage;
+
+#define COLOR_MAX_STAGES 8
+
+// A chain of color stages, start from make_color_pipeline.
+// COLORSPACE from, to: space of the input and of the output.
+// int n: number of stages.
+// color_stage stages: stages, run in order.
+typedef struct{
+    COLORSPACE from, to;
+    int n;
+    color_stage stages[COLOR_MAX_STAGES];
+} color_pipeline;
+
+// A lookup table of where to sample a source image for every output pixel.
+// int w, h: size of the output image.
+// int sw, sh: size of the source image the table was built for.
+// float *x, *y: source coordinates for each output pixel.
+typedef struct{
+    int w, h;
+    int sw, sh;
+    float *x, *y;
+} remap;
+
 // Basic operations
 float get_pixel(image im, int x, int y, int c);
 void set_pixel(image im, int x, int y, int c, float v);
@@ -57,6 +176,13 @@ void rgb_to_hsv(image im);
 void hsv_to_rgb(image im);
 void hcl_to_rgb(image im);
 void rgb_to_hcl(image im);
+void hcl_to_rgb_fast(image im);
+void rgb_to_hcl_fast(image im);
+color_pipeline make_color_pipeline(COLORSPACE from, COLORSPACE to);
+int color_pipeline_convert(color_pipeline *p, COLORSPACE to);
+int color_pipeline_affine(color_pipeline *p, float m[3][3], float bias[3]);
+image apply_color_pipeline(image im, color_pipeline p);
+image convert_colorspace(image im, COLORSPACE from, COLORSPACE to);
 void shift_image(image im, int c, float v);
 void scale_image(image im, int c, float v);
 void clamp_image(image im);
@@ -65,20 +191,61 @@ int same_image(image a, image b, float eps);
 image sub_image(image a, image b);
 image add_image(image a, image b);
 
+// Plane operations, element-wise over n contiguous floats
+void plane_add(float *out, const float *a, const float *b, int n);
+void plane_sub(float *out, const float *a, const float *b, int n);
+void plane_mul(float *out, const float *a, const float *b, int n);
+void plane_min(float *out, const float *a, const float *b, int n);
+void plane_max(float *out, const float *a, const float *b, int n);
+void plane_affine(float *out, const float *a, float scale, float bias, int n);
+void plane_clamp(float *out, const float *a, float lo, float hi, int n);
+void plane_affine_clamp(float *out, const float *a, float scale, float bias, float lo, float hi, int n);
+
 // Loading and saving
 image make_image(int w, int h, int c);
+image make_image_uninit(int w, int h, int c);
 image load_image(char *filename);
 void save_image(image im, const char *name);
 void save_image_binary(image im, const char *fname);
 image load_image_binary(const char *fname);
+image mmap_image(const char *fname);
+void munmap_image(image im);
+image_writer *open_image_writer(const char *fname, int w, int h, int c);
+int write_image_data(image_writer *wr, const float *data, int n);
+int close_image_writer(image_writer *wr);
 void save_png(image im, const char *name);
+void image_to_bytes(image im, unsigned char *data);
+int write_image_stb(image im, const char *name, int png);
+save_job *save_image_async(image im, const char *name, int png);
+int wait_save(save_job *job);
+void detach_save(save_job *job);
+void wait_all_saves();
 void free_image(image im);
 
+// 8 bit images
+image_u8 make_image_u8(int w, int h, int c);
+image_u8 make_image_u8_layout(int w, int h, int c, IMAGE_LAYOUT layout);
+void u8_strides(image_u8 im, int *ps, int *cs);
+image_u8 convert_layout_u8(image_u8 im, IMAGE_LAYOUT layout);
+void free_image_u8(image_u8 im);
+image_u8 load_image_u8(char *filename);
+void save_image_u8(image_u8 im, const char *name);
+void save_png_u8(image_u8 im, const char *name);
+image u8_to_image(image_u8 im);
+image_u8 image_to_u8(image im);
+image_u8 rgb_to_grayscale_u8(image_u8 im);
+image_u8 box_filter_u8(image_u8 im, int k);
+image_u8 convolve_image_u8(image_u8 im, image filter, int preserve);
+image_u8 resample_image_u8(image_u8 im, int w, int h, RESAMPLE_FILTER f);
+void save_image_u8_binary(image_u8 im, const char *fname);
+image_u8 load_image_u8_binary(const char *fname);
+
 // Resizing
 float nn_interpolate(image im, float x, float y, int c);
 image nn_resize(image im, int w, int h);
 float bilinear_interpolate(image im, float x, float y, int c);
 image bilinear_resize(image im, int w, int h);
+image resample_image(image im, int w, int h, RESAMPLE_FILTER f);
 
 // Filtering
 image convolve_image(image im, image filter, int preserve);
@@ -99,19 +266,53 @@ image smooth_image(image im, float sigma);
 // Harris and Stitching
 point make_point(float x, float y);
 point project_point(matrix H, point p);
+point project_point_mat3(mat3 H, point p);
 matrix compute_homography(match *matches, int n);
+int solve_homography(match *matches, int n, mat3 *H);
 image structure_matrix(image im, float sigma);
 image cornerness_response(image S);
+image max_filter_image(image im, int w);
+image nms_image(image im, int w);
+int *nms_indices(image im, int w, float thresh, int *n);
+keypoint *harris_keypoints(image im, harris_params p, int *n);
+int select_keypoints(keypoint *kp, int n, int max, int grid, int w, int h);
+image pyramid_down(image im);
+pyramid make_pyramid(image im, int levels);
+void free_pyramid(pyramid p);
+harris_params make_harris_params(float sigma, float thresh, int nms);
+descriptor *detect_features(image im, harris_params p, int *n);
+void enable_feature_cache(const char *dir);
+void disable_feature_cache();
+unsigned long long feature_cache_key(image im, harris_params p);
+descriptor *feature_cache_lookup(image im, harris_params p, int *n);
+void feature_cache_store(image im, harris_params p, descriptor *d, int n);
+image brief_smooth_image(image im);
+descriptor describe_binary(image smooth, int x, int y, float angle);
+descriptor describe_oriented(image im, int x, int y, float angle);
+float hamming_distance(unsigned long long *a, unsigned long long *b, int n);
 void free_descriptors(descriptor *d, int n);
 image cylindrical_project(image im, float f);
+image spherical_project(image im, float f);
+point project_cylinder(point p, float xc, float yc, float f);
+point project_spherical(point p, float xc, float yc, float f);
+remap make_projection_remap(int w, int h, float f, PROJECTION p);
+remap get_projection_remap(int w, int h, float f, PROJECTION p);
+image apply_remap(image im, remap r);
+void free_remap(remap r);
+void clear_remap_cache();
 void mark_corners(image im, descriptor *d, int n);
 image find_and_draw_matches(image a, image b, float sigma, float thresh, int nms);
 void detect_and_draw_corners(image im, float sigma, float thresh, int nms);
 int model_inliers(matrix H, match *m, int n, float thresh);
+int model_inliers_mat3(mat3 H, match *m, int n, float thresh);
 image combine_images(image a, image b, matrix H);
+int combine_images_tiled(image a, image b, matrix H, const char *fname, int tile);
+image load_image_tile(const char *fname, int tx, int ty);
 match *match_descriptors(descriptor *a, int an, descriptor *b, int bn, int *mn);
+match *match_descriptors_mutual(descriptor *a, int an, descriptor *b, int bn, int *mn);
 descriptor *harris_corner_detector(image im, float sigma, float thresh, int nms, int *n);
 image panorama_image(image a, image b, float sigma, float thresh, int nms, float inlier_thresh, int iters, int cutoff);
+image panorama_image_params(image a, image b, harris_params p, float inlier_thresh, int iters, int cutoff);
 
 // Optical Flow
 image make_integral_image(image im);
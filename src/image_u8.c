@@ -0,0 +1,344 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+
+#include "image.h"
+#include "stb_image.h"
+#include "stb_image_write.h"
+
+// 8 bit images and the kernels that can run on them directly. Samples are
+// 0 to 255 standing for 0 to 1, so u8_to_image(im) gives what load_image
+// would have. Arithmetic is integer or fixed point; anything that needs
+// negative or out of range values (gradients, high pass) should convert to
+// float first, since results here saturate to [0, 255].
+//
+// An image_u8 is either planar like image or interleaved like the buffers
+// stb and OpenCV use. Every kernel here takes either and returns the same
+// layout it was given, addressing samples through u8_strides.
+
+// Below this many output samples a kernel stays on one thread.
+#define U8_PARALLEL_MIN (1 << 16)
+
+// Fixed point fraction bits for convolution weights.
+#define U8_CONV_BITS 14
+
+image_u8 make_image_u8_layout(int w, int h, int c, IMAGE_LAYOUT layout)
+{
+    image_u8 out;
+    out.w = w;
+    out.h = h;
+    out.c = c;
+    out.data = calloc((size_t)w*h*c, sizeof(unsigned char));
+    out.layout = layout;
+    return out;
+}
+
+image_u8 make_image_u8(int w, int h, int c)
+{
+    return make_image_u8_layout(w, h, c, LAYOUT_PLANAR);
+}
+
+// Sample (x, y, k) is at data[(y*w + x)*ps + k*cs].
+// int *ps: filled with the distance between neighboring pixels.
+// int *cs: filled with the distance between channels of a pixel.
+void u8_strides(image_u8 im, int *ps, int *cs)
+{
+    *ps = (im.layout == LAYOUT_INTERLEAVED) ? im.c : 1;
+    *cs = (im.layout == LAYOUT_INTERLEAVED) ? 1 : im.w*im.h;
+}
+
+void free_image_u8(image_u8 im)
+{
+    free(im.data);
+}
+
+// Loads an image without converting it to float. The decoder's buffer is
+// kept as is, so the result is interleaved and nothing is copied. stb
+// allocates with malloc, so free_image_u8 releases it like any other.
+// char *filename: file to load.
+// returns: interleaved 8 bit image, alpha dropped like load_image.
+image_u8 load_image_u8(char *filename)
+{
+    int w, h, c;
+    // Ask stb to drop alpha while decoding instead of repacking after.
+    int want = 0;
+    if(stbi_info(filename, &w, &h, &c) && c == 4) want = 3;
+    unsigned char *data = stbi_load(filename, &w, &h, &c, want);
+    if (!data) {
+        fprintf(stderr, "Cannot load image \"%s\"\nSTB Reason: %s\n",
+            filename, stbi_failure_reason());
+        exit(0);
+    }
+    image_u8 im;
+    im.w = w;
+    im.h = h;
+    im.c = want ? want : c;
+    im.data = data;
+    im.layout = LAYOUT_INTERLEAVED;
+    return im;
+}
+
+// Copies an image into the given layout. Loops are written per layout
+// with fixed strides so the compiler turns them into vector shuffles.
+// image_u8 im: image to convert.
+// IMAGE_LAYOUT layout: layout wanted.
+// returns: new image, a plain copy if im already has that layout.
+image_u8 convert_layout_u8(image_u8 im, IMAGE_LAYOUT layout)
+{
+    image_u8 out = make_image_u8_layout(im.w, im.h, im.c, layout);
+    int n = im.w*im.h;
+    if(im.layout == layout || im.c == 1){
+        memcpy(out.data, im.data, (size_t)n*im.c);
+        return out;
+    }
+    const unsigned char *src = im.data;
+    unsigned char *dst = out.data;
+    int i, k;
+    if(im.c == 3 && layout == LAYOUT_PLANAR){
+        unsigned char *r = dst, *g = dst + n, *b = dst + 2*n;
+        #pragma omp parallel for simd if(n >= U8_PARALLEL_MIN)
+        for(i = 0; i < n; ++i){
+            r[i] = src[3*i];
+            g[i] = src[3*i + 1];
+            b[i] = src[3*i + 2];
+        }
+    } else if(im.c == 3){
+        const unsigned char *r = src, *g = src + n, *b = src + 2*n;
+        #pragma omp parallel for simd if(n >= U8_PARALLEL_MIN)
+        for(i = 0; i < n; ++i){
+            dst[3*i] = r[i];
+            dst[3*i + 1] = g[i];
+            dst[3*i + 2] = b[i];
+        }
+    } else {
+        int ips, ics, ops, ocs;
+        u8_strides(im, &ips, &ics);
+        u8_strides(out, &ops, &ocs);
+        for(k = 0; k < im.c; ++k){
+            for(i = 0; i < n; ++i) dst[i*ops + k*ocs] = src[i*ips + k*ics];
+        }
+    }
+    return out;
+}
+
+static void save_image_u8_stb(image_u8 im, const char *name, int png)
+{
+    char buff[256];
+    // Interleaved images are already what stb wants.
+    image_u8 inter = im;
+    if(im.layout != LAYOUT_INTERLEAVED) inter = convert_layout_u8(im, LAYOUT_INTERLEAVED);
+    int success = 0;
+    if(png){
+        sprintf(buff, "%s.png", name);
+        success = stbi_write_png(buff, im.w, im.h, im.c, inter.data, im.w*im.c);
+    } else {
+        sprintf(buff, "%s.jpg", name);
+        success = stbi_write_jpg(buff, im.w, im.h, im.c, inter.data, 100);
+    }
+    if(inter.data != im.data) free_image_u8(inter);
+    if(!success) fprintf(stderr, "Failed to write image %s\n", buff);
+}
+
+void save_image_u8(image_u8 im, const char *name)
+{
+    save_image_u8_stb(im, name, 0);
+}
+
+void save_png_u8(image_u8 im, const char *name)
+{
+    save_image_u8_stb(im, name, 1);
+}
+
+// Converts to a planar float image in [0, 1], deinterleaving if needed.
+image u8_to_image(image_u8 im)
+{
+    image out = make_image(im.w, im.h, im.c);
+    int n = im.w*im.h;
+    int i, k;
+    if(im.layout == LAYOUT_INTERLEAVED && im.c == 3){
+        float *r = out.data, *g = out.data + n, *b = out.data + 2*n;
+        const unsigned char *src = im.data;
+        #pragma omp parallel for simd if(n >= U8_PARALLEL_MIN)
+        for(i = 0; i < n; ++i){
+            r[i] = src[3*i]*(1.f/255);
+            g[i] = src[3*i + 1]*(1.f/255);
+            b[i] = src[3*i + 2]*(1.f/255);
+        }
+    } else if(im.layout == LAYOUT_INTERLEAVED && im.c > 1){
+        for(k = 0; k < im.c; ++k){
+            float *dst = out.data + k*n;
+            const unsigned char *src = im.data + k;
+            for(i = 0; i < n; ++i) dst[i] = src[i*im.c]*(1.f/255);
+        }
+    } else {
+        n *= im.c;
+        #pragma omp parallel for simd if(n >= U8_PARALLEL_MIN)
+        for(i = 0; i < n; ++i) out.data[i] = im.data[i]*(1.f/255);
+    }
+    return out;
+}
+
+// Converts a float image to planar 8 bits, clamping to [0, 1] and rounding.
+image_u8 image_to_u8(image im)
+{
+    image_u8 out = make_image_u8(im.w, im.h, im.c);
+    int n = im.w*im.h*im.c;
+    int i;
+    #pragma omp parallel for simd if(n >= U8_PARALLEL_MIN)
+    for(i = 0; i < n; ++i){
+        float v = MIN(MAX(im.data[i], 0), 1);
+        out.data[i] = (unsigned char)(v*255 + .5f);
+    }
+    return out;
+}
+
+// Luma with the weights rgb_to_grayscale uses, in 16 bit fixed point.
+// image_u8 im: RGB image.
+// returns: 1 channel image.
+image_u8 rgb_to_grayscale_u8(image_u8 im)
+{
+    assert(im.c == 3);
+    image_u8 out = make_image_u8_layout(im.w, im.h, 1, im.layout);
+    int n = im.w*im.h;
+    int ps, cs;
+    u8_strides(im, &ps, &cs);
+    const unsigned char *r = im.data, *g = im.data + cs, *b = im.data + 2*cs;
+    int i;
+    #pragma omp parallel for simd if(n >= U8_PARALLEL_MIN)
+    for(i = 0; i < n; ++i){
+        out.data[i] = (19595*r[i*ps] + 38470*g[i*ps] + 7471*b[i*ps] + 32768) >> 16;
+    }
+    return out;
+}
+
+// Same result as convolve_image with make_box_filter(k) and preserve, but
+// with running integer sums, so the cost doesn't grow with k.
+// image_u8 im: image to blur.
+// int k: width of the box.
+// returns: blurred image.
+image_u8 box_filter_u8(image_u8 im, int k)
+{
+    image_u8 out = make_image_u8_layout(im.w, im.h, im.c, im.layout);
+    int lo = k/2, hi = k - 1 - k/2;
+    int n = k*k;
+    int ps, cs;
+    u8_strides(im, &ps, &cs);
+    int ys = im.w*ps;
+    int c;
+    #pragma omp parallel for if(im.w*im.h*im.c >= U8_PARALLEL_MIN)
+    for(c = 0; c < im.c; ++c){
+        const unsigned char *src = im.data + c*cs;
+        unsigned char *dst = out.data + c*cs;
+        // Horizontal window sums for every row, then a sliding column sum.
+        int *rows = calloc((size_t)im.w*im.h, sizeof(int));
+        int *col = calloc(im.w, sizeof(int));
+        int x, y;
+        for(y = 0; y < im.h; ++y){
+            const unsigned char *s = src + y*ys;
+            int *r = rows + y*im.w;
+            int sum = 0;
+            for(x = -lo; x <= hi; ++x) sum += s[MIN(MAX(x, 0), im.w - 1)*ps];
+            for(x = 0; x < im.w; ++x){
+                r[x] = sum;
+                sum += s[MIN(x + hi + 1, im.w - 1)*ps] - s[MAX(x - lo, 0)*ps];
+            }
+        }
+        for(y = -lo; y <= hi; ++y){
+            const int *r = rows + MIN(MAX(y, 0), im.h - 1)*im.w;
+            for(x = 0; x < im.w; ++x) col[x] += r[x];
+        }
+        for(y = 0; y < im.h; ++y){
+            unsigned char *d = dst + y*ys;
+            const int *add = rows + MIN(y + hi + 1, im.h - 1)*im.w;
+            const int *sub = rows + MAX(y - lo, 0)*im.w;
+            for(x = 0; x < im.w; ++x){
+                d[x*ps] = (col[x] + n/2)/n;
+                col[x] += add[x] - sub[x];
+            }
+        }
+        free(rows);
+        free(col);
+    }
+    return out;
+}
+
+// Adds w * src[(x + dx)*ps] into acc for every x, clamping reads at the
+// edges.
+static void accumulate_row(int *acc, const unsigned char *src, int n, int ps, int dx, int w)
+{
+    int x0 = MIN(MAX(-dx, 0), n), x1 = MAX(MIN(n - dx, n), x0);
+    int x;
+    for(x = 0; x < x0; ++x) acc[x] += w*src[0];
+    #pragma omp simd
+    for(x = x0; x < x1; ++x) acc[x] += w*src[(x + dx)*ps];
+    for(x = x1; x < n; ++x) acc[x] += w*src[(n - 1)*ps];
+}
+
+// Rounds one filter channel to fixed point weights. The rounding error is
+// pushed onto the largest weight so the total matches the float filter's
+// and flat regions keep their level.
+static void quantize_filter(const float *f, int n, int *q)
+{
+    int i, big = 0;
+    float total = 0;
+    int qtotal = 0;
+    for(i = 0; i < n; ++i){
+        q[i] = (int)lroundf(f[i]*(1 << U8_CONV_BITS));
+        total += f[i];
+        qtotal += q[i];
+        if(fabsf(f[i]) > fabsf(f[big])) big = i;
+    }
+    q[big] += (int)lroundf(total*(1 << U8_CONV_BITS)) - qtotal;
+}
+
+// 8 bit convolve_image: same filter layout, edge clamping and preserve
+// meaning, with weights in fixed point and results saturated to [0, 255].
+// image_u8 im: image to filter.
+// image filter: float filter with 1 channel or im.c channels.
+// int preserve: 1 filters each channel, otherwise channels are summed
+//               into a single channel result.
+// returns: filtered image.
+image_u8 convolve_image_u8(image_u8 im, image filter, int preserve)
+{
+    assert((filter.c == 1) || (filter.c == im.c));
+    int taps = filter.w*filter.h;
+    int *q = calloc(taps*filter.c, sizeof(int));
+    int c;
+    for(c = 0; c < filter.c; ++c) quantize_filter(filter.data + c*taps, taps, q + c*taps);
+
+    image_u8 out = make_image_u8_layout(im.w, im.h, preserve == 1 ? im.c : 1, im.layout);
+    int ps, cs, ops, ocs;
+    u8_strides(im, &ps, &cs);
+    u8_strides(out, &ops, &ocs);
+    int x_pivot = filter.w/2, y_pivot = filter.h/2;
+    int y;
+    #pragma omp parallel for if(im.w*im.h*taps >= U8_PARALLEL_MIN)
+    for(y = 0; y < im.h; ++y){
+        int *acc = calloc(im.w, sizeof(int));
+        int x, i, j, k;
+        for(k = 0; k < im.c; ++k){
+            const int *w = q + (filter.c == im.c ? k : 0)*taps;
+            const unsigned char *plane = im.data + k*cs;
+            for(j = 0; j < filter.h; ++j){
+                int py = MIN(MAX(y - y_pivot + j, 0), im.h - 1);
+                for(i = 0; i < filter.w; ++i){
+                    int wij = w[j*filter.w + i];
+                    if(wij) accumulate_row(acc, plane + py*im.w*ps, im.w, ps, i - x_pivot, wij);
+                }
+            }
+            if(preserve == 1 || k == im.c - 1){
+                unsigned char *d = out.data + (preserve == 1 ? k : 0)*ocs + y*im.w*ops;
+                for(x = 0; x < im.w; ++x){
+                    int v = (acc[x] + (1 << (U8_CONV_BITS - 1))) >> U8_CONV_BITS;
+                    d[x*ops] = MIN(MAX(v, 0), 255);
+                    acc[x] = 0;
+                }
+            }
+        }
+        free(acc);
+    }
+    free(q);
+    return out;
+}
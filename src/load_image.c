@@ -17,7 +17,18 @@ image make_empty_image(int w, int h, int c)
 image make_image(int w, int h, int c)
 {
     image out = make_empty_image(w,h,c);
-    out.data = calloc(h*w*c, sizeof(float));
+    out.data = scratch_alloc((size_t)h*w*c*sizeof(float), 1);
+    if(!out.data) out.data = calloc(h*w*c, sizeof(float));
+    return out;
+}
+
+// make_image without clearing the pixels, for images that get every pixel
+// written before they are read. Only skips the clear inside a scratch scope.
+image make_image_uninit(int w, int h, int c)
+{
+    image out = make_empty_image(w,h,c);
+    out.data = scratch_alloc((size_t)h*w*c*sizeof(float), 0);
+    if(!out.data) out.data = calloc(h*w*c, sizeof(float));
     return out;
 }
 
@@ -26,16 +37,45 @@ image make_image(int w, int h, int c)
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb_image_write.h"
 
-void save_image_stb(image im, const char *name, int png)
+// Rounds to the nearest byte the way (unsigned char)roundf(255*v) does on
+// the usual targets, wrapping out of range values instead of clamping them,
+// but in a form the compiler can vectorize.
+static inline unsigned char float_to_byte(float v)
 {
-    char buff[256];
-    unsigned char *data = calloc(im.w*im.h*im.c, sizeof(char));
-    int i,k;
-    for(k = 0; k < im.c; ++k){
-        for(i = 0; i < im.w*im.h; ++i){
-            data[i*im.c+k] = (unsigned char) roundf((255*im.data[i + k*im.w*im.h]));
+    float s = 255*v;
+    return (unsigned char)(int)(s + (s < 0 ? -.5f : .5f));
+}
+
+// Converts a planar float image to interleaved bytes for the encoders.
+// image im: image to convert.
+// unsigned char *data: im.w*im.h*im.c bytes to fill.
+void image_to_bytes(image im, unsigned char *data)
+{
+    int n = im.w*im.h;
+    int i, k;
+    if(im.c == 3){
+        const float *r = im.data, *g = im.data + n, *b = im.data + 2*n;
+        #pragma omp simd
+        for(i = 0; i < n; ++i){
+            data[3*i] = float_to_byte(r[i]);
+            data[3*i + 1] = float_to_byte(g[i]);
+            data[3*i + 2] = float_to_byte(b[i]);
         }
+        return;
     }
+    for(k = 0; k < im.c; ++k){
+        const float *src = im.data + k*n;
+        for(i = 0; i < n; ++i) data[i*im.c + k] = float_to_byte(src[i]);
+    }
+}
+
+// Encodes and writes an image as name.png or name.jpg.
+// returns: 1 on success, 0 on failure.
+int write_image_stb(image im, const char *name, int png)
+{
+    char buff[256];
+    unsigned char *data = calloc(im.w*im.h*im.c, sizeof(char));
+    image_to_bytes(im, data);
     int success = 0;
     if(png){
         sprintf(buff, "%s.png", name);
@@ -46,6 +86,12 @@ void save_image_stb(image im, const char *name, int png)
     }
     free(data);
     if(!success) fprintf(stderr, "Failed to write image %s\n", buff);
+    return success != 0;
+}
+
+void save_image_stb(image im, const char *name, int png)
+{
+    write_image_stb(im, name, png);
 }
 
 void save_png(image im, const char *name)
@@ -96,32 +142,8 @@ image load_image(char *filename)
     return out;
 }
 
-void save_image_binary(image im, const char *fname)
-{
-    FILE *fp = fopen(fname, "wb");
-    fwrite(&im.w, sizeof(int), 1, fp);
-    fwrite(&im.h, sizeof(int), 1, fp);
-    fwrite(&im.c, sizeof(int), 1, fp);
-    fwrite(im.data, sizeof(float), im.w*im.h*im.c, fp);
-    fclose(fp);
-}
-
-image load_image_binary(const char *fname)
-{
-    int w = 0;
-    int h = 0;
-    int c = 0;
-    FILE *fp = fopen(fname, "rb");
-    fread(&w, sizeof(int), 1, fp);
-    fread(&h, sizeof(int), 1, fp);
-    fread(&c, sizeof(int), 1, fp);
-    image im = make_image(w,h,c);
-    fread(im.data, sizeof(float), im.w*im.h*im.c, fp);
-    return im;
-}
-
 void free_image(image im)
 {
-    free(im.data);
+    if(!scratch_release(im.data)) free(im.data);
 }
 
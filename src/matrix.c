@@ -1,30 +1,29 @@
 #include "matrix.h"
+#include "small_matrix.h"
+#include "scratch.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <math.h>
 
+// Heap versions for callers that need a matrix. Use mat3_identity and
+// mat3_translation from small_matrix.h to stay off the heap.
 matrix make_identity_homography()
 {
-    matrix H = make_matrix(3,3);   
-    H.data[0][0] = 1;
-    H.data[1][1] = 1;
-    H.data[2][2] = 1;
-    return H;
+    return mat3_to_matrix(mat3_identity());
 }
 
 matrix make_translation_homography(float dx, float dy)
 {
-    matrix H = make_identity_homography();
-    H.data[0][2] = dx;
-    H.data[1][2] = dy;
-    return H;
+    return mat3_to_matrix(mat3_translation(dx, dy));
 }
 
 void free_matrix(matrix m)
 {
     if (m.data) {
+        // Pool matrices are one block holding the row pointers and rows.
+        if (scratch_release(m.data)) return;
         int i;
         if (!m.shallow) for(i = 0; i < m.rows; ++i) free(m.data[i]);
         free(m.data);
@@ -37,8 +36,17 @@ matrix make_matrix(int rows, int cols)
     m.rows = rows;
     m.cols = cols;
     m.shallow = 0;
-    m.data = calloc(m.rows, sizeof(double *));
     int i;
+    size_t ptrs = (rows*sizeof(double *) + sizeof(double) - 1)/sizeof(double)*sizeof(double);
+    char *block = scratch_alloc(ptrs + (size_t)rows*cols*sizeof(double), 0);
+    if(block){
+        m.data = (double **)block;
+        double *rowdata = (double *)(block + ptrs);
+        memset(rowdata, 0, (size_t)rows*cols*sizeof(double));
+        for(i = 0; i < m.rows; ++i) m.data[i] = rowdata + (size_t)i*cols;
+        return m;
+    }
+    m.data = calloc(m.rows, sizeof(double *));
     for(i = 0; i < m.rows; ++i) m.data[i] = calloc(m.cols, sizeof(double));
     return m;
 }
@@ -139,14 +147,9 @@ matrix axpy_matrix(double a, matrix x, matrix y)
 
 matrix transpose_matrix(matrix m)
 {
-    matrix t;
-    t.rows = m.cols;
-    t.cols = m.rows;
-    t.data = calloc(t.rows, sizeof(double *));
-    t.shallow = 0;
+    matrix t = make_matrix(m.cols, m.rows);
     int i, j;
     for(i = 0; i < t.rows; ++i){
-        t.data[i] = calloc(t.cols, sizeof(double));
         for(j = 0; j < t.cols; ++j){
             t.data[i][j] = m.data[j][i];
         }
@@ -0,0 +1,74 @@
+#include <stdlib.h>
+#include <math.h>
+#include "image.h"
+
+// Below this many floats a plane op isn't worth waking up threads for.
+#define PLANE_PARALLEL_MIN (1 << 16)
+
+// Element-wise operations over contiguous float planes. Images are planar,
+// so a channel is im.data + c*im.w*im.h and a whole image is one plane of
+// im.w*im.h*im.c floats. out may be the same buffer as an input.
+
+// out = a + b
+void plane_add(float *out, const float *a, const float *b, int n)
+{
+    int i;
+    #pragma omp parallel for simd if(n >= PLANE_PARALLEL_MIN)
+    for(i = 0; i < n; ++i) out[i] = a[i] + b[i];
+}
+
+// out = a - b
+void plane_sub(float *out, const float *a, const float *b, int n)
+{
+    int i;
+    #pragma omp parallel for simd if(n >= PLANE_PARALLEL_MIN)
+    for(i = 0; i < n; ++i) out[i] = a[i] - b[i];
+}
+
+// out = a * b
+void plane_mul(float *out, const float *a, const float *b, int n)
+{
+    int i;
+    #pragma omp parallel for simd if(n >= PLANE_PARALLEL_MIN)
+    for(i = 0; i < n; ++i) out[i] = a[i] * b[i];
+}
+
+// out = min(a, b)
+void plane_min(float *out, const float *a, const float *b, int n)
+{
+    int i;
+    #pragma omp parallel for simd if(n >= PLANE_PARALLEL_MIN)
+    for(i = 0; i < n; ++i) out[i] = MIN(a[i], b[i]);
+}
+
+// out = max(a, b)
+void plane_max(float *out, const float *a, const float *b, int n)
+{
+    int i;
+    #pragma omp parallel for simd if(n >= PLANE_PARALLEL_MIN)
+    for(i = 0; i < n; ++i) out[i] = MAX(a[i], b[i]);
+}
+
+// out = a * scale + bias, covers adding or multiplying by a scalar.
+void plane_affine(float *out, const float *a, float scale, float bias, int n)
+{
+    int i;
+    #pragma omp parallel for simd if(n >= PLANE_PARALLEL_MIN)
+    for(i = 0; i < n; ++i) out[i] = a[i]*scale + bias;
+}
+
+// out = a clamped to [lo, hi]
+void plane_clamp(float *out, const float *a, float lo, float hi, int n)
+{
+    int i;
+    #pragma omp parallel for simd if(n >= PLANE_PARALLEL_MIN)
+    for(i = 0; i < n; ++i) out[i] = MAX(MIN(a[i], hi), lo);
+}
+
+// out = a * scale + bias clamped to [lo, hi], one pass instead of two.
+void plane_affine_clamp(float *out, const float *a, float scale, float bias, float lo, float hi, int n)
+{
+    int i;
+    #pragma omp parallel for simd if(n >= PLANE_PARALLEL_MIN)
+    for(i = 0; i < n; ++i) out[i] = MAX(MIN(a[i]*scale + bias, hi), lo);
+}
@@ -0,0 +1,314 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "image.h"
+
+// Raw image files: a RAW_IMAGE_HEADER_SIZE byte header, then the samples
+// exactly as they sit in memory. The header is padded so the payload starts
+// 64 byte aligned, which lets mmap_image hand out the mapped bytes as an
+// image with no copy. Files from before the header existed start with w
+// directly and are still read by load_image_binary.
+
+#define RAW_IMAGE_HEADER_SIZE 64
+// Magic an image_writer puts in its placeholder header, swapped for
+// RAW_IMAGE_MAGIC once the image is complete.
+#define RAW_IMAGE_MAGIC_PARTIAL 0x50525755
+
+typedef struct{
+    unsigned int magic;
+    unsigned int version;
+    int w, h, c;
+    int dtype;
+    int layout;
+    int reserved;
+    unsigned long long size;
+    unsigned long long checksum;
+    char pad[RAW_IMAGE_HEADER_SIZE - 48];
+} raw_image_header;
+
+typedef char raw_header_is_64_bytes[sizeof(raw_image_header) == RAW_IMAGE_HEADER_SIZE ? 1 : -1];
+
+// 64 bit FNV-1a over 4 byte words, any bytes past the last word folded in
+// one at a time. Float payloads are whole words however they are split up,
+// so an image_writer can hash piece by piece and get the same value.
+// unsigned long long h: hash so far.
+// const void *data: bytes to add.
+// size_t n: number of bytes.
+// returns: updated hash.
+static unsigned long long raw_checksum(unsigned long long h, const void *data, size_t n)
+{
+    const unsigned char *p = data;
+    size_t i;
+    for(i = 0; i + 4 <= n; i += 4){
+        unsigned int word;
+        memcpy(&word, p + i, 4);
+        h = (h ^ word) * 1099511628211ULL;
+    }
+    for(; i < n; ++i) h = (h ^ p[i]) * 1099511628211ULL;
+    return h;
+}
+
+#define RAW_CHECKSUM_SEED 14695981039346656037ULL
+
+static raw_image_header make_raw_header(int w, int h, int c, RAW_DTYPE dtype, IMAGE_LAYOUT layout)
+{
+    raw_image_header hd;
+    memset(&hd, 0, sizeof(hd));
+    hd.magic = RAW_IMAGE_MAGIC;
+    hd.version = RAW_IMAGE_VERSION;
+    hd.w = w;
+    hd.h = h;
+    hd.c = c;
+    hd.dtype = dtype;
+    hd.layout = layout;
+    hd.size = (unsigned long long)w*h*c*(dtype == RAW_F32 ? sizeof(float) : 1);
+    return hd;
+}
+
+static int write_raw(const char *fname, raw_image_header hd, const void *data)
+{
+    FILE *fp = fopen(fname, "wb");
+    if(!fp){
+        fprintf(stderr, "Couldn't open file %s\n", fname);
+        return 0;
+    }
+    hd.checksum = raw_checksum(RAW_CHECKSUM_SEED, data, hd.size);
+    int ok = fwrite(&hd, sizeof(hd), 1, fp) == 1 &&
+             fwrite(data, 1, hd.size, fp) == hd.size;
+    ok &= fclose(fp) == 0;
+    if(!ok) fprintf(stderr, "Failed to write image %s\n", fname);
+    return ok;
+}
+
+// Reads and checks a header, leaving fp at the start of the payload.
+// returns: 1 if the header is valid and matches the file size.
+static int read_raw_header(FILE *fp, raw_image_header *hd)
+{
+    memset(hd, 0, sizeof(*hd));
+    if(fread(hd, sizeof(*hd), 1, fp) != 1) return 0;
+    if(hd->magic != RAW_IMAGE_MAGIC || hd->version != RAW_IMAGE_VERSION) return 0;
+    if(hd->w < 0 || hd->h < 0 || hd->c < 0) return 0;
+    if(hd->dtype != RAW_F32 && hd->dtype != RAW_U8) return 0;
+    raw_image_header expect = make_raw_header(hd->w, hd->h, hd->c, hd->dtype, hd->layout);
+    return hd->size == expect.size;
+}
+
+// Reads the payload and verifies it against the header's checksum.
+static int read_raw_payload(FILE *fp, raw_image_header hd, void *data, const char *fname)
+{
+    if(fread(data, 1, hd.size, fp) != hd.size){
+        fprintf(stderr, "Truncated image file %s\n", fname);
+        return 0;
+    }
+    if(raw_checksum(RAW_CHECKSUM_SEED, data, hd.size) != hd.checksum){
+        fprintf(stderr, "Checksum mismatch in image file %s\n", fname);
+        return 0;
+    }
+    return 1;
+}
+
+void save_image_binary(image im, const char *fname)
+{
+    write_raw(fname, make_raw_header(im.w, im.h, im.c, RAW_F32, LAYOUT_PLANAR), im.data);
+}
+
+// Files from before the versioned header: 3 ints w, h, c then the floats.
+// With no magic to go on, a file only counts as legacy if its size is
+// exactly what those dimensions call for.
+static image load_image_binary_legacy(FILE *fp, const char *fname)
+{
+    image none = {0};
+    int dims[3] = {0};
+    unsigned long long size, pixels;
+    int ok = fseek(fp, 0, SEEK_END) == 0;
+    long end = ftell(fp);
+    rewind(fp);
+    ok = ok && end >= 0 && fread(dims, sizeof(int), 3, fp) == 3 &&
+         dims[0] >= 0 && dims[1] >= 0 && dims[2] >= 0 &&
+         !__builtin_mul_overflow((unsigned long long)dims[0], (unsigned long long)dims[1], &pixels) &&
+         !__builtin_mul_overflow(pixels, (unsigned long long)dims[2]*sizeof(float), &size) &&
+         size == (unsigned long long)end - 3*sizeof(int);
+    if(!ok){
+        fprintf(stderr, "Not an image file %s\n", fname);
+        return none;
+    }
+    image im = make_image(dims[0], dims[1], dims[2]);
+    size_t n = (size_t)im.w*im.h*im.c;
+    if(fread(im.data, sizeof(float), n, fp) != n){
+        fprintf(stderr, "Truncated image file %s\n", fname);
+        free_image(im);
+        return none;
+    }
+    return im;
+}
+
+// Loads an image written by save_image_binary, current or legacy format.
+// const char *fname: file to read.
+// returns: the image, or an empty image if the file is missing, malformed
+//          or fails its checksum.
+image load_image_binary(const char *fname)
+{
+    image none = {0};
+    FILE *fp = fopen(fname, "rb");
+    if(!fp){
+        fprintf(stderr, "Couldn't open file %s\n", fname);
+        return none;
+    }
+    raw_image_header hd;
+    image im = none;
+    if(!read_raw_header(fp, &hd)){
+        if(hd.magic == RAW_IMAGE_MAGIC_PARTIAL) fprintf(stderr, "Incomplete image file %s\n", fname);
+        else if(hd.magic != RAW_IMAGE_MAGIC) im = load_image_binary_legacy(fp, fname);
+        else fprintf(stderr, "Bad header in image file %s\n", fname);
+    } else if(hd.dtype != RAW_F32){
+        fprintf(stderr, "Image file %s doesn't hold floats\n", fname);
+    } else {
+        im = make_image(hd.w, hd.h, hd.c);
+        if(!read_raw_payload(fp, hd, im.data, fname)){
+            free_image(im);
+            im = none;
+        }
+    }
+    fclose(fp);
+    return im;
+}
+
+void save_image_u8_binary(image_u8 im, const char *fname)
+{
+    write_raw(fname, make_raw_header(im.w, im.h, im.c, RAW_U8, im.layout), im.data);
+}
+
+// Loads an 8 bit image written by save_image_u8_binary, keeping its layout.
+// returns: the image, empty if the file is missing, malformed or corrupt.
+image_u8 load_image_u8_binary(const char *fname)
+{
+    image_u8 none = {0};
+    FILE *fp = fopen(fname, "rb");
+    if(!fp){
+        fprintf(stderr, "Couldn't open file %s\n", fname);
+        return none;
+    }
+    raw_image_header hd;
+    image_u8 im = none;
+    if(!read_raw_header(fp, &hd) || hd.dtype != RAW_U8){
+        fprintf(stderr, "Not an 8 bit image file %s\n", fname);
+    } else {
+        im = make_image_u8_layout(hd.w, hd.h, hd.c, hd.layout);
+        if(!read_raw_payload(fp, hd, im.data, fname)){
+            free_image_u8(im);
+            im = none;
+        }
+    }
+    fclose(fp);
+    return im;
+}
+
+// Maps a float image file read-only. The data pointer of the result points
+// straight into the page cache: nothing is read until it is touched, and
+// writing to it faults. The checksum is not verified, that would read the
+// whole file. Release it with munmap_image, never free_image.
+// const char *fname: file written by save_image_binary or an image_writer.
+// returns: the mapped image, empty on failure or for legacy files.
+image mmap_image(const char *fname)
+{
+    image none = {0};
+    int fd = open(fname, O_RDONLY);
+    if(fd < 0){
+        fprintf(stderr, "Couldn't open file %s\n", fname);
+        return none;
+    }
+    raw_image_header hd;
+    struct stat st;
+    int ok = read(fd, &hd, sizeof(hd)) == (ssize_t)sizeof(hd) && fstat(fd, &st) == 0;
+    ok = ok && hd.magic == RAW_IMAGE_MAGIC && hd.version == RAW_IMAGE_VERSION &&
+         hd.dtype == RAW_F32 && hd.w >= 0 && hd.h >= 0 && hd.c >= 0 &&
+         hd.size == (unsigned long long)hd.w*hd.h*hd.c*sizeof(float) &&
+         (unsigned long long)st.st_size >= sizeof(hd) + hd.size;
+    if(!ok){
+        fprintf(stderr, "Can't map image file %s\n", fname);
+        close(fd);
+        return none;
+    }
+    void *base = mmap(0, sizeof(hd) + hd.size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(base == MAP_FAILED){
+        fprintf(stderr, "Can't map image file %s\n", fname);
+        return none;
+    }
+    image im;
+    im.w = hd.w;
+    im.h = hd.h;
+    im.c = hd.c;
+    im.data = (float *)((char *)base + sizeof(hd));
+    return im;
+}
+
+// Unmaps an image returned by mmap_image.
+void munmap_image(image im)
+{
+    if(!im.data) return;
+    munmap((char *)im.data - RAW_IMAGE_HEADER_SIZE,
+           RAW_IMAGE_HEADER_SIZE + (size_t)im.w*im.h*im.c*sizeof(float));
+}
+
+// Streams a float image to disk a piece at a time, for outputs too big to
+// hold in memory. Samples go in planar order, the same order as image.data.
+struct image_writer{
+    FILE *fp;
+    raw_image_header hd;
+    unsigned long long written;
+    unsigned long long checksum;
+};
+
+// Opens a file for streaming and writes a placeholder header.
+// int w, h, c: size of the image that will be written.
+// returns: writer, or 0 if the file can't be opened.
+image_writer *open_image_writer(const char *fname, int w, int h, int c)
+{
+    FILE *fp = fopen(fname, "wb");
+    if(!fp){
+        fprintf(stderr, "Couldn't open file %s\n", fname);
+        return 0;
+    }
+    image_writer *wr = calloc(1, sizeof(image_writer));
+    wr->fp = fp;
+    wr->hd = make_raw_header(w, h, c, RAW_F32, LAYOUT_PLANAR);
+    wr->checksum = RAW_CHECKSUM_SEED;
+    // The real magic only goes in at close, so a half written file never
+    // loads.
+    raw_image_header blank = wr->hd;
+    blank.magic = RAW_IMAGE_MAGIC_PARTIAL;
+    fwrite(&blank, sizeof(blank), 1, fp);
+    return wr;
+}
+
+// Appends the next n samples.
+// returns: 1 on success, 0 on a write error or if it would overrun the image.
+int write_image_data(image_writer *wr, const float *data, int n)
+{
+    unsigned long long bytes = (unsigned long long)n*sizeof(float);
+    if(n < 0 || wr->written + bytes > wr->hd.size) return 0;
+    if(fwrite(data, sizeof(float), n, wr->fp) != (size_t)n) return 0;
+    wr->checksum = raw_checksum(wr->checksum, data, bytes);
+    wr->written += bytes;
+    return 1;
+}
+
+// Finishes the header and closes the file.
+// returns: 1 if every sample was written and the file is complete.
+int close_image_writer(image_writer *wr)
+{
+    int ok = wr->written == wr->hd.size;
+    if(ok){
+        wr->hd.checksum = wr->checksum;
+        ok = fseek(wr->fp, 0, SEEK_SET) == 0 && fwrite(&wr->hd, sizeof(wr->hd), 1, wr->fp) == 1;
+    }
+    ok &= fclose(wr->fp) == 0;
+    free(wr);
+    return ok;
+}
@@ -0,0 +1,215 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "scratch.h"
+
+// Scratch pools for image and matrix buffers. While a thread is inside a
+// scratch scope, make_image and make_matrix take their buffers from that
+// thread's pool, and freeing them hands the buffer back to the pool instead
+// of to free. A loop that makes and frees the same sizes every iteration
+// stops calling malloc after the first one. Buffers are rounded up to size
+// classes, four per power of two, so near sizes share blocks.
+//
+// Buffers stay valid until they are freed like any other, scopes only
+// decide whether they get recycled. Anything freed after the outermost
+// scope has been popped, or freed on another thread, goes straight back to
+// free. Popping the outermost scope releases everything the pool cached.
+//
+// Every pool block is recorded in one table so a free from any thread can
+// tell pool blocks from calloc'd ones. The table is only looked at while
+// pool blocks exist.
+
+// Smallest block, 2^SCRATCH_MIN_SHIFT bytes.
+#define SCRATCH_MIN_SHIFT 6
+#define SCRATCH_CLASSES (4*(48 - SCRATCH_MIN_SHIFT))
+#define SCRATCH_ALIGN 64
+
+typedef struct{
+    int depth;
+    void *free_list[SCRATCH_CLASSES];
+    int fresh, reused;
+} scratch_pool;
+
+typedef struct{
+    void *p;
+    int cls;
+    scratch_pool *owner;
+} scratch_entry;
+
+static _Thread_local scratch_pool scratch_tls;
+
+static pthread_mutex_t scratch_lock = PTHREAD_MUTEX_INITIALIZER;
+static scratch_entry *scratch_table = 0;
+static size_t scratch_cap = 0;
+static size_t scratch_count = 0;
+
+// Rounds a size up to its class.
+// size_t n: bytes wanted.
+// size_t *bytes: filled with the block size of the class.
+// returns: class index.
+static int scratch_class(size_t n, size_t *bytes)
+{
+    if(n < ((size_t)1 << SCRATCH_MIN_SHIFT)) n = (size_t)1 << SCRATCH_MIN_SHIFT;
+    int e = 63 - __builtin_clzll(n);
+    size_t base = (size_t)1 << e, step = base/4;
+    size_t m = (n - base + step - 1)/step;
+    if(m == 4){
+        ++e;
+        m = 0;
+        base <<= 1;
+        step <<= 1;
+    }
+    *bytes = base + m*step;
+    return (e - SCRATCH_MIN_SHIFT)*4 + (int)m;
+}
+
+static size_t scratch_slot(void *p, size_t cap)
+{
+    size_t h = (size_t)p / SCRATCH_ALIGN;
+    h *= 0x9E3779B97F4A7C15ULL;
+    return (h >> 17) & (cap - 1);
+}
+
+// Table operations, called with scratch_lock held.
+static scratch_entry *scratch_find(void *p)
+{
+    if(!scratch_cap) return 0;
+    size_t i = scratch_slot(p, scratch_cap);
+    while(scratch_table[i].p){
+        if(scratch_table[i].p == p) return scratch_table + i;
+        i = (i + 1) & (scratch_cap - 1);
+    }
+    return 0;
+}
+
+static void scratch_insert(scratch_entry e)
+{
+    if(2*(scratch_count + 1) > scratch_cap){
+        size_t cap = scratch_cap ? 2*scratch_cap : 256;
+        scratch_entry *old = scratch_table;
+        size_t old_cap = scratch_cap, i;
+        scratch_table = calloc(cap, sizeof(scratch_entry));
+        scratch_cap = cap;
+        for(i = 0; i < old_cap; ++i){
+            if(!old[i].p) continue;
+            size_t j = scratch_slot(old[i].p, cap);
+            while(scratch_table[j].p) j = (j + 1) & (cap - 1);
+            scratch_table[j] = old[i];
+        }
+        free(old);
+    }
+    size_t i = scratch_slot(e.p, scratch_cap);
+    while(scratch_table[i].p) i = (i + 1) & (scratch_cap - 1);
+    scratch_table[i] = e;
+    __atomic_store_n(&scratch_count, scratch_count + 1, __ATOMIC_RELEASE);
+}
+
+// Removes an entry, shifting later entries of the same probe run back so
+// lookups never stop early.
+static void scratch_remove(scratch_entry *e)
+{
+    size_t i = e - scratch_table, j = i;
+    scratch_table[i].p = 0;
+    while(1){
+        j = (j + 1) & (scratch_cap - 1);
+        if(!scratch_table[j].p) break;
+        size_t k = scratch_slot(scratch_table[j].p, scratch_cap);
+        // Move j into the hole at i unless its home slot lies in (i, j].
+        if((j > i && (k <= i || k > j)) || (j < i && (k <= i && k > j))){
+            scratch_table[i] = scratch_table[j];
+            scratch_table[j].p = 0;
+            i = j;
+        }
+    }
+    __atomic_store_n(&scratch_count, scratch_count - 1, __ATOMIC_RELEASE);
+}
+
+// Enters a scratch scope on this thread. Scopes nest.
+void push_scratch_scope()
+{
+    ++scratch_tls.depth;
+}
+
+// Leaves a scratch scope. Leaving the outermost one frees every block the
+// pool is holding for reuse; blocks still in use are untouched.
+void pop_scratch_scope()
+{
+    scratch_pool *pool = &scratch_tls;
+    if(pool->depth <= 0) return;
+    if(--pool->depth) return;
+    int c;
+    for(c = 0; c < SCRATCH_CLASSES; ++c){
+        while(pool->free_list[c]){
+            void *p = pool->free_list[c];
+            pool->free_list[c] = *(void **)p;
+            pthread_mutex_lock(&scratch_lock);
+            scratch_entry *e = scratch_find(p);
+            if(e) scratch_remove(e);
+            pthread_mutex_unlock(&scratch_lock);
+            free(p);
+        }
+    }
+}
+
+// Takes a block from this thread's pool.
+// size_t size: bytes wanted.
+// int zero: 1 to clear the first size bytes, 0 to leave them as they are.
+// returns: the block, or 0 if the thread isn't in a scratch scope.
+void *scratch_alloc(size_t size, int zero)
+{
+    scratch_pool *pool = &scratch_tls;
+    if(pool->depth <= 0 || size == 0) return 0;
+    size_t bytes;
+    int cls = scratch_class(size, &bytes);
+    void *p = pool->free_list[cls];
+    if(p){
+        pool->free_list[cls] = *(void **)p;
+        ++pool->reused;
+    } else {
+        if(posix_memalign(&p, SCRATCH_ALIGN, bytes)) return 0;
+        scratch_entry e = {p, cls, pool};
+        pthread_mutex_lock(&scratch_lock);
+        scratch_insert(e);
+        pthread_mutex_unlock(&scratch_lock);
+        ++pool->fresh;
+    }
+    if(zero) memset(p, 0, size);
+    return p;
+}
+
+// Gives a block back if it came from a scratch pool.
+// void *p: buffer being freed.
+// returns: 1 if it was a pool block and has been dealt with, 0 if the
+//          caller should free it normally.
+int scratch_release(void *p)
+{
+    if(!p || !__atomic_load_n(&scratch_count, __ATOMIC_ACQUIRE)) return 0;
+    scratch_pool *pool = &scratch_tls;
+    pthread_mutex_lock(&scratch_lock);
+    scratch_entry *e = scratch_find(p);
+    if(!e){
+        pthread_mutex_unlock(&scratch_lock);
+        return 0;
+    }
+    if(e->owner == pool && pool->depth > 0){
+        int cls = e->cls;
+        pthread_mutex_unlock(&scratch_lock);
+        *(void **)p = pool->free_list[cls];
+        pool->free_list[cls] = p;
+        return 1;
+    }
+    scratch_remove(e);
+    pthread_mutex_unlock(&scratch_lock);
+    free(p);
+    return 1;
+}
+
+// Counts pool activity on this thread since it started.
+// int *fresh: filled with blocks that had to be malloc'd.
+// int *reused: filled with blocks handed out again from the pool.
+void scratch_stats(int *fresh, int *reused)
+{
+    *fresh = scratch_tls.fresh;
+    *reused = scratch_tls.reused;
+}
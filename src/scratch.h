@@ -0,0 +1,19 @@
+#ifndef SCRATCH_H
+#define SCRATCH_H
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Per-thread buffer pools for make_image and make_matrix, see scratch.c.
+void push_scratch_scope();
+void pop_scratch_scope();
+void *scratch_alloc(size_t size, int zero);
+int scratch_release(void *p);
+void scratch_stats(int *fresh, int *reused);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
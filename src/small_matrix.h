@@ -0,0 +1,172 @@
+#ifndef SMALL_MATRIX_H
+#define SMALL_MATRIX_H
+#include <math.h>
+#include <string.h>
+#include "matrix.h"
+
+// Fixed-size square matrices that live on the stack. Use these instead of
+// make_matrix for tiny systems (2x2 flow, 3x3 homographies, 8x8 solves) so
+// the hot loops never touch malloc. Everything is static inline so the
+// compiler can fully unroll for the known size.
+//
+// DEFINE_SMALL_MATRIX(N) declares:
+//   matN                 struct with double m[N][N]
+//   matN_zero()          all zeros
+//   matN_identity()      identity
+//   matN_mult(a, b)      a*b
+//   matN_transpose(a)    a^T
+//   matN_mult_vector(a, v, out)  out = a*v, v and out have N elements
+//   matN_solve(a, b, x)  solve a*x = b with partial pivoting, 0 if singular
+//   matN_from_matrix(m)  copy out of a heap matrix (must be NxN)
+//   matN_to_matrix(a)    copy into a new heap matrix
+
+#define DEFINE_SMALL_MATRIX(N) \
+typedef struct{ double m[N][N]; } mat##N; \
+\
+static inline mat##N mat##N##_zero(void) \
+{ \
+    mat##N a; \
+    memset(&a, 0, sizeof(a)); \
+    return a; \
+} \
+\
+static inline mat##N mat##N##_identity(void) \
+{ \
+    mat##N a = mat##N##_zero(); \
+    int i; \
+    for(i = 0; i < N; ++i) a.m[i][i] = 1; \
+    return a; \
+} \
+\
+static inline mat##N mat##N##_mult(mat##N a, mat##N b) \
+{ \
+    mat##N p = mat##N##_zero(); \
+    int i, j, k; \
+    for(i = 0; i < N; ++i){ \
+        for(k = 0; k < N; ++k){ \
+            for(j = 0; j < N; ++j){ \
+                p.m[i][j] += a.m[i][k]*b.m[k][j]; \
+            } \
+        } \
+    } \
+    return p; \
+} \
+\
+static inline mat##N mat##N##_transpose(mat##N a) \
+{ \
+    mat##N t; \
+    int i, j; \
+    for(i = 0; i < N; ++i) for(j = 0; j < N; ++j) t.m[i][j] = a.m[j][i]; \
+    return t; \
+} \
+\
+static inline void mat##N##_mult_vector(mat##N a, const double *v, double *out) \
+{ \
+    int i, j; \
+    for(i = 0; i < N; ++i){ \
+        double s = 0; \
+        for(j = 0; j < N; ++j) s += a.m[i][j]*v[j]; \
+        out[i] = s; \
+    } \
+} \
+\
+static inline int mat##N##_solve(mat##N a, const double *b, double *x) \
+{ \
+    double r[N]; \
+    int i, j, k; \
+    for(i = 0; i < N; ++i) r[i] = b[i]; \
+    for(k = 0; k < N; ++k){ \
+        int p = k; \
+        for(i = k+1; i < N; ++i) if(fabs(a.m[i][k]) > fabs(a.m[p][k])) p = i; \
+        if(fabs(a.m[p][k]) < 1e-12) return 0; \
+        if(p != k){ \
+            for(j = 0; j < N; ++j){ double t = a.m[k][j]; a.m[k][j] = a.m[p][j]; a.m[p][j] = t; } \
+            double t = r[k]; r[k] = r[p]; r[p] = t; \
+        } \
+        for(i = k+1; i < N; ++i){ \
+            double s = a.m[i][k]/a.m[k][k]; \
+            for(j = k; j < N; ++j) a.m[i][j] -= s*a.m[k][j]; \
+            r[i] -= s*r[k]; \
+        } \
+    } \
+    for(i = N-1; i >= 0; --i){ \
+        double v = r[i]; \
+        for(j = i+1; j < N; ++j) v -= a.m[i][j]*x[j]; \
+        x[i] = v/a.m[i][i]; \
+    } \
+    return 1; \
+} \
+\
+static inline mat##N mat##N##_from_matrix(matrix m) \
+{ \
+    mat##N a; \
+    int i, j; \
+    for(i = 0; i < N; ++i) for(j = 0; j < N; ++j) a.m[i][j] = m.data[i][j]; \
+    return a; \
+} \
+\
+static inline matrix mat##N##_to_matrix(mat##N a) \
+{ \
+    matrix m = make_matrix(N, N); \
+    int i, j; \
+    for(i = 0; i < N; ++i) for(j = 0; j < N; ++j) m.data[i][j] = a.m[i][j]; \
+    return m; \
+}
+
+DEFINE_SMALL_MATRIX(2)
+DEFINE_SMALL_MATRIX(3)
+DEFINE_SMALL_MATRIX(8)
+
+// Closed form determinants and inverses for the sizes we use per pixel.
+// The invert functions return 0 and leave *inv alone if a is singular.
+
+static inline double mat2_det(mat2 a)
+{
+    return a.m[0][0]*a.m[1][1] - a.m[0][1]*a.m[1][0];
+}
+
+static inline int mat2_invert(mat2 a, mat2 *inv)
+{
+    double d = mat2_det(a);
+    if(d == 0) return 0;
+    inv->m[0][0] =  a.m[1][1]/d;
+    inv->m[0][1] = -a.m[0][1]/d;
+    inv->m[1][0] = -a.m[1][0]/d;
+    inv->m[1][1] =  a.m[0][0]/d;
+    return 1;
+}
+
+static inline double mat3_det(mat3 a)
+{
+    return a.m[0][0]*(a.m[1][1]*a.m[2][2] - a.m[1][2]*a.m[2][1])
+         - a.m[0][1]*(a.m[1][0]*a.m[2][2] - a.m[1][2]*a.m[2][0])
+         + a.m[0][2]*(a.m[1][0]*a.m[2][1] - a.m[1][1]*a.m[2][0]);
+}
+
+static inline int mat3_invert(mat3 a, mat3 *inv)
+{
+    double d = mat3_det(a);
+    if(d == 0) return 0;
+    mat3 r;
+    r.m[0][0] =  (a.m[1][1]*a.m[2][2] - a.m[1][2]*a.m[2][1])/d;
+    r.m[0][1] = -(a.m[0][1]*a.m[2][2] - a.m[0][2]*a.m[2][1])/d;
+    r.m[0][2] =  (a.m[0][1]*a.m[1][2] - a.m[0][2]*a.m[1][1])/d;
+    r.m[1][0] = -(a.m[1][0]*a.m[2][2] - a.m[1][2]*a.m[2][0])/d;
+    r.m[1][1] =  (a.m[0][0]*a.m[2][2] - a.m[0][2]*a.m[2][0])/d;
+    r.m[1][2] = -(a.m[0][0]*a.m[1][2] - a.m[0][2]*a.m[1][0])/d;
+    r.m[2][0] =  (a.m[1][0]*a.m[2][1] - a.m[1][1]*a.m[2][0])/d;
+    r.m[2][1] = -(a.m[0][0]*a.m[2][1] - a.m[0][1]*a.m[2][0])/d;
+    r.m[2][2] =  (a.m[0][0]*a.m[1][1] - a.m[0][1]*a.m[1][0])/d;
+    *inv = r;
+    return 1;
+}
+
+static inline mat3 mat3_translation(double dx, double dy)
+{
+    mat3 a = mat3_identity();
+    a.m[0][2] = dx;
+    a.m[1][2] = dy;
+    return a;
+}
+
+#endif
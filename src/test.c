@@ -166,6 +166,110 @@ void test_clamp()
     free_image(c);
 }
 
+void test_image_binary()
+{
+    image im = load_image("data/dog.jpg");
+    save_image_binary(im, "test_image.bin");
+    image back = load_image_binary("test_image.bin");
+    TEST(back.w == im.w && back.h == im.h && back.c == im.c &&
+         memcmp(back.data, im.data, im.w*im.h*im.c*sizeof(float)) == 0);
+    free_image(back);
+
+    image mapped = mmap_image("test_image.bin");
+    TEST(mapped.w == im.w && mapped.data &&
+         memcmp(mapped.data, im.data, im.w*im.h*im.c*sizeof(float)) == 0);
+    munmap_image(mapped);
+
+    // Streaming one row at a time, odd row lengths included, gives the
+    // same file.
+    image odd = make_image(im.w - 1, 3, 1);
+    int i;
+    for(i = 0; i < odd.w*odd.h; ++i) odd.data[i] = i*.5f;
+    image_writer *wr = open_image_writer("test_stream.bin", odd.w, odd.h, odd.c);
+    int ok = wr != 0;
+    for(i = 0; i < odd.h && ok; ++i) ok = write_image_data(wr, odd.data + i*odd.w, odd.w);
+    ok = ok && !write_image_data(wr, odd.data, 1);
+    ok = close_image_writer(wr) && ok;
+    TEST(ok);
+    back = load_image_binary("test_stream.bin");
+    TEST(back.w == odd.w && memcmp(back.data, odd.data, odd.w*odd.h*sizeof(float)) == 0);
+    free_image(back);
+    free_image(odd);
+
+    // A flipped payload byte fails the checksum.
+    FILE *fp = fopen("test_image.bin", "r+b");
+    fseek(fp, 1000, SEEK_SET);
+    int b = fgetc(fp);
+    fseek(fp, 1000, SEEK_SET);
+    fputc(b ^ 1, fp);
+    fclose(fp);
+    back = load_image_binary("test_image.bin");
+    TEST(back.data == 0);
+
+    // So does a flipped bit in the magic, it isn't taken for a legacy file.
+    save_image_binary(im, "test_image.bin");
+    fp = fopen("test_image.bin", "r+b");
+    b = fgetc(fp);
+    rewind(fp);
+    fputc(b ^ 4, fp);
+    fclose(fp);
+    back = load_image_binary("test_image.bin");
+    TEST(back.data == 0);
+
+    // A writer that hasn't been closed, or was closed short, leaves a file
+    // that won't load. Half the image is more than stdio buffers, so the
+    // header is on disk.
+    image big = make_image(64, 64, 1);
+    wr = open_image_writer("test_stream.bin", big.w, big.h, big.c);
+    write_image_data(wr, big.data, big.w*big.h/2);
+    back = load_image_binary("test_stream.bin");
+    ok = back.data == 0;
+    ok = !close_image_writer(wr) && ok;
+    back = load_image_binary("test_stream.bin");
+    TEST(ok && back.data == 0);
+    free_image(big);
+    remove("test_image.bin");
+    remove("test_stream.bin");
+
+    // Files written before the header existed still load.
+    image legacy = load_image_binary("data/dotsintegral.bin");
+    TEST(legacy.data && legacy.w > 0 && legacy.c > 0);
+    free_image(legacy);
+
+    image_u8 im8 = load_image_u8("data/dog.jpg");
+    save_image_u8_binary(im8, "test_image.bin");
+    image_u8 back8 = load_image_u8_binary("test_image.bin");
+    TEST(back8.layout == im8.layout && memcmp(back8.data, im8.data, im.w*im.h*im.c) == 0);
+    remove("test_image.bin");
+    free_image_u8(im8);
+    free_image_u8(back8);
+    free_image(im);
+}
+
+void test_save_async()
+{
+    image im = load_image("data/dogsmall.jpg");
+    save_png(im, "test_sync");
+    save_job *job = save_image_async(copy_image(im), "test_async", 1);
+    // A detached save still gets written before wait_all_saves returns.
+    detach_save(save_image_async(copy_image(im), "test_detached", 1));
+    TEST(wait_save(job));
+    wait_all_saves();
+
+    image sync = load_image("test_sync.png");
+    image async = load_image("test_async.png");
+    image detached = load_image("test_detached.png");
+    TEST(same_image(async, sync, 0.0001) && same_image(detached, sync, 0.0001));
+    TEST(same_image(async, im, 1./255));
+    remove("test_sync.png");
+    remove("test_async.png");
+    remove("test_detached.png");
+    free_image(sync);
+    free_image(async);
+    free_image(detached);
+    free_image(im);
+}
+
 void test_shift()
 {
     image im = load_image("data/dog.jpg");
@@ -179,6 +283,157 @@ void test_shift()
     free_image(c);
 }
 
+void test_plane_ops()
+{
+    image im = load_image("data/dog.jpg");
+    int n = im.w*im.h*im.c;
+    int i, same = 1;
+
+    // Fused scale and clamp matches the two steps done separately.
+    image a = copy_image(im);
+    image b = copy_image(im);
+    plane_affine_clamp(a.data, a.data, 1.7, -.2, 0, 1, n);
+    scale_image(b, 0, 1.7); scale_image(b, 1, 1.7); scale_image(b, 2, 1.7);
+    shift_image(b, 0, -.2); shift_image(b, 1, -.2); shift_image(b, 2, -.2);
+    clamp_image(b);
+    TEST(same_image(a, b, EPS));
+
+    image sum = add_image(im, a);
+    image diff = sub_image(sum, a);
+    TEST(same_image(diff, im, EPS));
+
+    plane_min(b.data, im.data, a.data, n);
+    plane_max(sum.data, im.data, a.data, n);
+    plane_mul(diff.data, im.data, a.data, n);
+    for(i = 0; i < n && same; ++i){
+        same = b.data[i] == MIN(im.data[i], a.data[i]) &&
+               sum.data[i] == MAX(im.data[i], a.data[i]) &&
+               within_eps(diff.data[i], im.data[i]*a.data[i], EPS);
+    }
+    TEST(same);
+    free_image(im);
+    free_image(a);
+    free_image(b);
+    free_image(sum);
+    free_image(diff);
+}
+
+void test_hcl_fast()
+{
+    image im = load_image("data/dog.jpg");
+    image exact = copy_image(im);
+    image fast = copy_image(im);
+    rgb_to_hcl(exact);
+    rgb_to_hcl_fast(fast);
+    int n = im.w*im.h;
+    int i, same = 1;
+    for(i = 0; i < n; ++i){
+        // Hue wraps around at 1.
+        float dh = fabs(exact.data[i] - fast.data[i]);
+        dh = MIN(dh, 1 - dh);
+        // Hue means nothing for gray pixels, skip the ones with no chroma.
+        if(exact.data[n + i] > .001 && dh > EPS) same = 0;
+    }
+    for(i = n; i < 3*n; ++i){
+        if(!within_eps(exact.data[i], fast.data[i], EPS)) same = 0;
+    }
+    TEST(same);
+
+    // Back to RGB from the same HCL values.
+    memcpy(fast.data, exact.data, 3*n*sizeof(float));
+    hcl_to_rgb(exact);
+    hcl_to_rgb_fast(fast);
+    same = 1;
+    for(i = 0; i < 3*n; ++i){
+        // The exact version gives NaN out of gamut, the fast one clamps.
+        if(isnan(exact.data[i])) continue;
+        if(!within_eps(exact.data[i], fast.data[i], EPS)) same = 0;
+    }
+    TEST(same);
+    free_image(im);
+    free_image(exact);
+    free_image(fast);
+}
+
+void test_colorspace()
+{
+    image im = load_image("data/dog.jpg");
+
+    // White and black land where Lab says they should.
+    image wb = make_image(2, 1, 3);
+    set_pixel(wb, 0, 0, 0, 1); set_pixel(wb, 0, 0, 1, 1); set_pixel(wb, 0, 0, 2, 1);
+    image lab = convert_colorspace(wb, COLOR_RGB, COLOR_LAB);
+    TEST(within_eps(get_pixel(lab, 0, 0, 0), 100, .01) && within_eps(get_pixel(lab, 0, 0, 1), 0, .01) &&
+         within_eps(get_pixel(lab, 0, 0, 2), 0, .01) && within_eps(get_pixel(lab, 1, 0, 0), 0, .01));
+    free_image(lab);
+    free_image(wb);
+
+    // Round trips.
+    COLORSPACE spaces[] = {COLOR_LINEAR_RGB, COLOR_XYZ, COLOR_LAB, COLOR_YCBCR};
+    int i, k;
+    for(k = 0; k < 4; ++k){
+        color_pipeline p = make_color_pipeline(COLOR_RGB, spaces[k]);
+        color_pipeline_convert(&p, COLOR_RGB);
+        image back = apply_color_pipeline(im, p);
+        TEST(same_image(back, im, EPS));
+        free_image(back);
+    }
+
+    // The fused chain with an adjustment matches running it in steps.
+    float boost[3][3] = {{1, 0, 0}, {0, 1.3, 0}, {0, 0, 1.3}};
+    float shift[3] = {-5, 0, 0};
+    color_pipeline p = make_color_pipeline(COLOR_RGB, COLOR_LAB);
+    color_pipeline_affine(&p, boost, shift);
+    color_pipeline_convert(&p, COLOR_RGB);
+    TEST(p.n <= 4);
+    image fused = apply_color_pipeline(im, p);
+    image step = convert_colorspace(im, COLOR_RGB, COLOR_LAB);
+    int n = im.w*im.h;
+    for(i = 0; i < n; ++i){
+        step.data[i] -= 5;
+        step.data[n + i] *= 1.3;
+        step.data[2*n + i] *= 1.3;
+    }
+    image stepped = convert_colorspace(step, COLOR_LAB, COLOR_RGB);
+    TEST(same_image(fused, stepped, EPS));
+
+    // Each Lab round trip adds 3 stages, so the way back of the third one
+    // would need a ninth. It's refused whole instead of run short a stage.
+    color_pipeline chainp = make_color_pipeline(COLOR_RGB, COLOR_RGB);
+    int fits = 1;
+    for(k = 0; k < 2; ++k){
+        fits &= color_pipeline_convert(&chainp, COLOR_LAB);
+        fits &= color_pipeline_convert(&chainp, COLOR_RGB);
+    }
+    fits &= color_pipeline_convert(&chainp, COLOR_LAB);
+    color_pipeline full = chainp;
+    int refused = !color_pipeline_convert(&chainp, COLOR_RGB);
+    refused &= chainp.n == full.n && chainp.to == COLOR_LAB &&
+               memcmp(chainp.stages, full.stages, sizeof(full.stages)) == 0;
+    TEST(fits && refused);
+    image chained = apply_color_pipeline(im, chainp);
+    image direct = convert_colorspace(im, COLOR_RGB, COLOR_LAB);
+    // Lab runs to 100, compare absolute differences.
+    float worst = 0;
+    for(i = 0; i < 3*im.w*im.h; ++i) worst = MAX(worst, fabs(chained.data[i] - direct.data[i]));
+    TEST(chained.c == 3 && worst < .01);
+    free_image(chained);
+    free_image(direct);
+
+    image y = convert_colorspace(im, COLOR_RGB, COLOR_YCBCR);
+    image g1 = convert_colorspace(y, COLOR_YCBCR, COLOR_GRAY);
+    image g2 = rgb_to_grayscale(im);
+    TEST(g1.c == 1 && same_image(g1, g2, EPS));
+
+    free_image(fused);
+    free_image(step);
+    free_image(stepped);
+    free_image(y);
+    free_image(g1);
+    free_image(g2);
+    free_image(im);
+}
+
 void test_rgb_to_hsv()
 {
     image im = load_image("data/dog.jpg");
@@ -277,6 +532,120 @@ void test_multiple_resize()
 }
 
 
+void test_resample_image()
+{
+    image im = load_image("data/dogsmall.jpg");
+    RESAMPLE_FILTER f[] = {RESAMPLE_NEAREST, RESAMPLE_BILINEAR, RESAMPLE_BICUBIC, RESAMPLE_LANCZOS, RESAMPLE_AREA};
+    int i;
+    for(i = 0; i < 5; ++i){
+        // Same size samples exactly on pixel centers.
+        image same = resample_image(im, im.w, im.h, f[i]);
+        TEST(same_image(same, im, EPS));
+        free_image(same);
+
+        // Normalized weights keep a flat image flat at any scale.
+        image flat = make_image(37, 23, 1);
+        int j;
+        for(j = 0; j < flat.w*flat.h; ++j) flat.data[j] = .4;
+        image up = resample_image(flat, 101, 57, f[i]);
+        image down = resample_image(flat, 11, 7, f[i]);
+        int ok = 1;
+        for(j = 0; j < up.w*up.h; ++j) ok &= within_eps(up.data[j], .4, EPS);
+        for(j = 0; j < down.w*down.h; ++j) ok &= within_eps(down.data[j], .4, EPS);
+        TEST(ok);
+        free_image(flat);
+        free_image(up);
+        free_image(down);
+    }
+
+    // Sharper kernels stay close to bilinear on a smooth upsample.
+    image bl = resample_image(im, im.w*4, im.h*4, RESAMPLE_BILINEAR);
+    image bc = resample_image(im, im.w*4, im.h*4, RESAMPLE_BICUBIC);
+    image lz = resample_image(im, im.w*4, im.h*4, RESAMPLE_LANCZOS);
+    TEST(same_image(bc, bl, .2));
+    TEST(same_image(lz, bc, .1));
+    free_image(bl);
+    free_image(bc);
+    free_image(lz);
+    free_image(im);
+
+    // Averaging 8x8 blocks is an 8x8 box blur sampled at block centers.
+    image dog = load_image("data/dog.jpg");
+    image box = make_box_filter(8);
+    image blur = convolve_image(dog, box, 1);
+    image thumb = nn_resize(blur, dog.w/8, dog.h/8);
+    image area = resample_image(dog, dog.w/8, dog.h/8, RESAMPLE_AREA);
+    TEST(same_image(area, thumb, EPS));
+    free_image(dog);
+    free_image(box);
+    free_image(blur);
+    free_image(thumb);
+    free_image(area);
+}
+
+
+// Resizes pixel by pixel through the interpolation functions, the way the
+// resizers worked before the tap tables and fast paths.
+image reference_resize(image im, int w, int h, int bilinear)
+{
+    image out = make_image(w, h, im.c);
+    float sx = (float)im.w/w, sy = (float)im.h/h;
+    int x, y, c;
+    for(c = 0; c < im.c; ++c){
+        for(y = 0; y < h; ++y){
+            for(x = 0; x < w; ++x){
+                float px = x*sx + (sx/2 - .5), py = y*sy + (sy/2 - .5);
+                float v = bilinear ? bilinear_interpolate(im, px, py, c) : nn_interpolate(im, px, py, c);
+                set_pixel(out, x, y, c, v);
+            }
+        }
+    }
+    return out;
+}
+
+void test_integer_resize()
+{
+    image im = load_image("data/dogsmall.jpg");
+    int k;
+    for(k = 2; k <= 4; k *= 2){
+        image a = nn_resize(im, im.w*k, im.h*k);
+        image b = reference_resize(im, im.w*k, im.h*k, 0);
+        TEST(same_image(a, b, EPS));
+        free_image(a);
+        free_image(b);
+
+        a = nn_resize(im, im.w/k, im.h/k);
+        b = reference_resize(im, im.w/k, im.h/k, 0);
+        TEST(same_image(a, b, EPS));
+        free_image(a);
+        free_image(b);
+
+        a = bilinear_resize(im, im.w/k, im.h/k);
+        b = reference_resize(im, im.w/k, im.h/k, 1);
+        TEST(same_image(a, b, EPS));
+        free_image(a);
+        free_image(b);
+
+        // Area halving and quartering are plain block means.
+        image box = make_box_filter(k);
+        image blur = convolve_image(im, box, 1);
+        a = resample_image(im, im.w/k, im.h/k, RESAMPLE_AREA);
+        b = nn_resize(blur, im.w/k, im.h/k);
+        TEST(same_image(a, b, EPS));
+        free_image(a);
+        free_image(b);
+        free_image(box);
+        free_image(blur);
+    }
+    image a = bilinear_resize(im, im.w*2, im.h*2);
+    image b = reference_resize(im, im.w*2, im.h*2, 1);
+    TEST(same_image(a, b, EPS));
+    free_image(a);
+    free_image(b);
+    free_image(im);
+}
+
+
 void test_highpass_filter(){
     image im = load_image("data/dog.jpg");
     image f = make_highpass_filter();
@@ -447,6 +816,123 @@ void test_sobel(){
     free(res);
 }
 
+// 8 bit kernels give the float result to within rounding, two steps of
+// 1/255 covers the worst case of rounding twice.
+void test_image_u8()
+{
+    float tol = 2.f/255;
+    image im = load_image("data/dog.jpg");
+    image_u8 im8 = load_image_u8("data/dog.jpg");
+    image back = u8_to_image(im8);
+    TEST(same_image(back, im, EPS));
+    image_u8 round = image_to_u8(back);
+    image_u8 planar = convert_layout_u8(im8, LAYOUT_PLANAR);
+    TEST(memcmp(round.data, planar.data, im.w*im.h*im.c) == 0);
+    free_image(back);
+    free_image_u8(round);
+    free_image_u8(planar);
+
+    image gray = rgb_to_grayscale(im);
+    image_u8 gray8 = rgb_to_grayscale_u8(im8);
+    back = u8_to_image(gray8);
+    TEST(same_image(back, gray, tol));
+    free_image(back);
+    free_image(gray);
+    free_image_u8(gray8);
+
+    image box = make_box_filter(7);
+    image blur = convolve_image(im, box, 1);
+    image_u8 blur8 = box_filter_u8(im8, 7);
+    back = u8_to_image(blur8);
+    TEST(same_image(back, blur, tol));
+    free_image(back);
+    free_image_u8(blur8);
+    blur8 = convolve_image_u8(im8, box, 1);
+    back = u8_to_image(blur8);
+    TEST(same_image(back, blur, tol));
+    free_image(back);
+    free_image_u8(blur8);
+    free_image(blur);
+    free_image(box);
+
+    image f = make_gaussian_filter(2);
+    blur = convolve_image(im, f, 1);
+    blur8 = convolve_image_u8(im8, f, 1);
+    back = u8_to_image(blur8);
+    TEST(same_image(back, blur, tol));
+    free_image(back);
+    free_image_u8(blur8);
+    free_image(blur);
+    free_image(f);
+
+    image small = bilinear_resize(im, 713, 467);
+    image_u8 small8 = resample_image_u8(im8, 713, 467, RESAMPLE_BILINEAR);
+    back = u8_to_image(small8);
+    TEST(same_image(back, small, tol));
+    free_image(back);
+    free_image(small);
+    free_image_u8(small8);
+
+    free_image(im);
+    free_image_u8(im8);
+}
+
+// Same image in both layouts has to give the same bytes from every kernel.
+int same_image_u8(image_u8 a, image_u8 b)
+{
+    image_u8 pa = convert_layout_u8(a, LAYOUT_PLANAR);
+    image_u8 pb = convert_layout_u8(b, LAYOUT_PLANAR);
+    int same = a.w == b.w && a.h == b.h && a.c == b.c &&
+               memcmp(pa.data, pb.data, a.w*a.h*a.c) == 0;
+    free_image_u8(pa);
+    free_image_u8(pb);
+    return same;
+}
+
+void test_image_u8_layout()
+{
+    image_u8 inter = load_image_u8("data/dog.jpg");
+    image_u8 planar = convert_layout_u8(inter, LAYOUT_PLANAR);
+    TEST(inter.layout == LAYOUT_INTERLEAVED && planar.layout == LAYOUT_PLANAR);
+    image_u8 again = convert_layout_u8(planar, LAYOUT_INTERLEAVED);
+    TEST(memcmp(again.data, inter.data, inter.w*inter.h*inter.c) == 0);
+    free_image_u8(again);
+
+    image a = u8_to_image(inter);
+    image b = u8_to_image(planar);
+    TEST(same_image(a, b, 0.0001));
+    free_image(a);
+    free_image(b);
+
+    image_u8 x = rgb_to_grayscale_u8(inter), y = rgb_to_grayscale_u8(planar);
+    TEST(same_image_u8(x, y));
+    free_image_u8(x);
+    free_image_u8(y);
+
+    x = box_filter_u8(inter, 5);
+    y = box_filter_u8(planar, 5);
+    TEST(x.layout == LAYOUT_INTERLEAVED && same_image_u8(x, y));
+    free_image_u8(x);
+    free_image_u8(y);
+
+    image f = make_gaussian_filter(1);
+    x = convolve_image_u8(inter, f, 1);
+    y = convolve_image_u8(planar, f, 1);
+    TEST(same_image_u8(x, y));
+    free_image_u8(x);
+    free_image_u8(y);
+    free_image(f);
+
+    x = resample_image_u8(inter, 301, 207, RESAMPLE_LANCZOS);
+    y = resample_image_u8(planar, 301, 207, RESAMPLE_LANCZOS);
+    TEST(x.layout == LAYOUT_INTERLEAVED && same_image_u8(x, y));
+    free_image_u8(x);
+    free_image_u8(y);
+
+    free_image_u8(inter);
+    free_image_u8(planar);
+}
+
 void test_structure()
 {
     image im = load_image("data/dogbw.png");
@@ -474,6 +960,342 @@ void test_cornerness()
 }
 
 
+void test_nms()
+{
+    image im = load_image("data/dogbw.png");
+    image s = structure_matrix(im, 2);
+    image c = cornerness_response(s);
+    image r = nms_image(c, 3);
+
+    // Brute force reference.
+    int x, y, i, j;
+    int same = 1;
+    int count = 0;
+    for(y = 0; y < c.h; ++y){
+        for(x = 0; x < c.w; ++x){
+            float v = get_pixel(c, x, y, 0);
+            int keep = 1;
+            for(j = -3; j <= 3; ++j){
+                for(i = -3; i <= 3; ++i){
+                    if(get_pixel(c, x+i, y+j, 0) > v) keep = 0;
+                }
+            }
+            if(keep != (get_pixel(r, x, y, 0) == v)) same = 0;
+            if(keep && v >= .0001) ++count;
+        }
+    }
+    TEST(same);
+
+    int n = 0;
+    int *idx = nms_indices(c, 3, .0001, &n);
+    TEST(n == count);
+    free(idx);
+    free_image(im);
+    free_image(s);
+    free_image(c);
+    free_image(r);
+}
+
+void test_harris_keypoints()
+{
+    image im = load_image("data/Rainier1.png");
+    image s = structure_matrix(im, 2);
+    image c = cornerness_response(s);
+    int n = 0, m = 0;
+    int *idx = nms_indices(c, 3, 5, &n);
+    harris_params p = make_harris_params(2, 5, 3);
+    p.subpixel = 0;
+    keypoint *kp = harris_keypoints(im, p, &m);
+    TEST(n == m);
+    int i;
+    int same = (n == m);
+    for(i = 0; i < n && same; ++i){
+        if(idx[i] != (int)kp[i].p.x + im.w*(int)kp[i].p.y) same = 0;
+        if(!within_eps(kp[i].response, c.data[idx[i]], EPS*fabs(c.data[idx[i]]))) same = 0;
+    }
+    TEST(same);
+
+    // Sub-pixel refinement moves corners by at most half a pixel.
+    p.subpixel = 1;
+    keypoint *sp = harris_keypoints(im, p, &m);
+    int close = (n == m), moved = 0;
+    for(i = 0; i < n && close; ++i){
+        float dx = sp[i].p.x - kp[i].p.x;
+        float dy = sp[i].p.y - kp[i].p.y;
+        if(fabs(dx) > .5 || fabs(dy) > .5) close = 0;
+        if(dx != 0 || dy != 0) ++moved;
+    }
+    TEST(close && moved > 0);
+
+    // nms 0 suppresses nothing, every pixel over the threshold comes back.
+    p = make_harris_params(2, 50, 0);
+    keypoint *all = harris_keypoints(im, p, &m);
+    int over = 0;
+    for(i = 0; i < c.w*c.h; ++i) over += c.data[i] >= 50;
+    TEST(m == over);
+    free(all);
+    free(sp);
+    free(idx);
+    free(kp);
+    free_image(im);
+    free_image(s);
+    free_image(c);
+}
+
+void test_select_keypoints()
+{
+    image im = load_image("data/Rainier1.png");
+    int n = 0;
+    harris_params p = make_harris_params(2, 1, 3);
+    p.subpixel = 0;
+    keypoint *kp = harris_keypoints(im, p, &n);
+    keypoint *all = calloc(n, sizeof(keypoint));
+    memcpy(all, kp, n*sizeof(keypoint));
+
+    int k = select_keypoints(kp, n, 50, 0, im.w, im.h);
+    TEST(k == 50);
+    float weakest = kp[0].response;
+    int i, stronger = 0;
+    for(i = 1; i < k; ++i) weakest = MIN(weakest, kp[i].response);
+    for(i = 0; i < n; ++i) stronger += all[i].response > weakest;
+    TEST(stronger < 50);
+
+    memcpy(kp, all, n*sizeof(keypoint));
+    k = select_keypoints(kp, n, 64, 4, im.w, im.h);
+    TEST(k == 64);
+
+    // Fewer corners than cells, the cap still holds.
+    memcpy(kp, all, n*sizeof(keypoint));
+    k = select_keypoints(kp, n, 10, 4, im.w, im.h);
+    TEST(k == 10);
+
+    // 50 over 16 cells: every cell still gets its 3, the other 2 go to
+    // the strongest of what's left.
+    memcpy(kp, all, n*sizeof(keypoint));
+    k = select_keypoints(kp, n, 50, 4, im.w, im.h);
+    int kept[16] = {0}, total[16] = {0};
+    for(i = 0; i < n; ++i){
+        int c = MIN(3, (int)(kp[i].p.y*4/im.h))*4 + MIN(3, (int)(kp[i].p.x*4/im.w));
+        ++total[c];
+        if(i < k) ++kept[c];
+    }
+    int fair = 1;
+    for(i = 0; i < 16; ++i) fair &= kept[i] >= MIN(total[i], 3);
+    TEST(k == 50 && fair);
+    free(kp);
+    free(all);
+    free_image(im);
+}
+
+void test_multiscale_features()
+{
+    image im = load_image("data/Rainier1.png");
+    pyramid pyr = make_pyramid(im, 4);
+    TEST(pyr.n == 4 && pyr.levels[3].w == (((im.w+1)/2+1)/2+1)/2);
+    TEST(same_image(pyr.levels[0], im, EPS));
+    free_pyramid(pyr);
+
+    // A flat image stays flat all the way down.
+    image flat = make_image(40, 30, 1);
+    int i;
+    for(i = 0; i < 40*30; ++i) flat.data[i] = .25;
+    image half = pyramid_down(flat);
+    int same = half.w == 20 && half.h == 15;
+    for(i = 0; i < half.w*half.h; ++i) if(!within_eps(half.data[i], .25, EPS)) same = 0;
+    TEST(same);
+    free_image(flat);
+    free_image(half);
+
+    harris_params p = make_harris_params(2, 5, 3);
+    int n = 0, m = 0;
+    descriptor *d1 = detect_features(im, p, &n);
+    p.octaves = 3;
+    descriptor *d3 = detect_features(im, p, &m);
+    int inside = 1;
+    for(i = 0; i < m; ++i){
+        if(d3[i].p.x < 0 || d3[i].p.x >= im.w || d3[i].p.y < 0 || d3[i].p.y >= im.h) inside = 0;
+    }
+    TEST(m > 0 && inside);
+
+    // Corners of a half size copy should show up at full size too, within
+    // the cross-scale suppression radius.
+    image small = pyramid_down(im);
+    int sn = 0, found = 0, j;
+    descriptor *ds = detect_features(small, make_harris_params(2, 5, 3), &sn);
+    for(i = 0; i < sn; ++i){
+        for(j = 0; j < m; ++j){
+            if(fabs(2*ds[i].p.x - d3[j].p.x) <= 6 && fabs(2*ds[i].p.y - d3[j].p.y) <= 6){
+                ++found;
+                break;
+            }
+        }
+    }
+    TEST(found >= sn*9/10);
+
+    // A blurry corner is kept at its own scale. Compared raw, the coarsest
+    // octave always answers strongest and wins well off the corner.
+    image corner = make_image(256, 256, 1);
+    for(i = 0; i < 256*256; ++i) corner.data[i] = (i%256 >= 128 && i/256 >= 128);
+    image g = make_gaussian_filter(4);
+    image blurry = convolve_image(corner, g, 1);
+    harris_params cp = make_harris_params(2, .001, 3);
+    cp.octaves = 4;
+    int cn = 0;
+    descriptor *dc = detect_features(blurry, cp, &cn);
+    float nearest = 1e9;
+    for(i = 0; i < cn; ++i) nearest = MIN(nearest, hypotf(dc[i].p.x - 128, dc[i].p.y - 128));
+    TEST(nearest < 6);
+    free_descriptors(dc, cn);
+    free_image(corner);
+    free_image(g);
+    free_image(blurry);
+    free_descriptors(ds, sn);
+    free_descriptors(d1, n);
+    free_descriptors(d3, m);
+    free_image(small);
+    free_image(im);
+}
+
+void test_oriented_descriptors()
+{
+    image im = load_image("data/Rainier1.png");
+    // Turn the image a quarter turn: (x, y) goes to (y, w-1-x).
+    image rot = make_image(im.h, im.w, im.c);
+    int i, j, c;
+    for(c = 0; c < im.c; ++c){
+        for(j = 0; j < im.h; ++j){
+            for(i = 0; i < im.w; ++i){
+                set_pixel(rot, j, im.w - 1 - i, c, get_pixel(im, i, j, c));
+            }
+        }
+    }
+    harris_params p = make_harris_params(2, 5, 3);
+    p.oriented = 1;
+    int n = 0, m = 0;
+    descriptor *a = detect_features(im, p, &n);
+    descriptor *b = detect_features(rot, p, &m);
+    int paired = 0, same = 0;
+    for(i = 0; i < n; ++i){
+        point q = make_point(a[i].p.y, im.w - 1 - a[i].p.x);
+        for(j = 0; j < m; ++j){
+            if(!same_point(q, b[j].p, .01)) continue;
+            int k, match = a[i].n == b[j].n;
+            for(k = 0; k < a[i].n && match; ++k) match = within_eps(a[i].data[k], b[j].data[k], EPS);
+            same += match;
+            ++paired;
+            break;
+        }
+    }
+    TEST(n == m && paired == n);
+    TEST(same >= paired*9/10);
+    free_descriptors(a, n);
+    free_descriptors(b, m);
+
+    // Binary descriptors rotate with the corner too, a few bits can flip
+    // where the smoothed image is nearly flat.
+    p.binary = 1;
+    a = detect_features(im, p, &n);
+    b = detect_features(rot, p, &m);
+    same = 0;
+    for(i = 0; i < n; ++i){
+        point q = make_point(a[i].p.y, im.w - 1 - a[i].p.x);
+        for(j = 0; j < m; ++j){
+            if(!same_point(q, b[j].p, .01)) continue;
+            if(hamming_distance(a[i].bits, b[j].bits, a[i].n) <= 8) ++same;
+            break;
+        }
+    }
+    TEST(same >= n*9/10);
+    free_descriptors(a, n);
+    free_descriptors(b, m);
+    free_image(rot);
+    free_image(im);
+}
+
+void test_feature_cache()
+{
+    image im = load_image("data/Rainier1.png");
+    harris_params p = make_harris_params(2, 50, 3);
+    int n = 0, m = 0, k = 0, i;
+    descriptor *d = detect_features(im, p, &n);
+
+    enable_feature_cache(".");
+    descriptor *first = detect_features(im, p, &m);
+    char fname[64];
+    sprintf(fname, "./%016llx.feat", feature_cache_key(im, p));
+    FILE *fp = fopen(fname, "rb");
+    TEST(fp != 0);
+    if(fp) fclose(fp);
+
+    // Memory hit, then a fresh cache that has to read the file back.
+    descriptor *hit = detect_features(im, p, &k);
+    disable_feature_cache();
+    enable_feature_cache(".");
+    int dn = 0;
+    descriptor *disk = detect_features(im, p, &dn);
+    int same = (m == n && k == n && dn == n);
+    for(i = 0; i < n && same; ++i){
+        same = !memcmp(&d[i].p, &hit[i].p, sizeof(point)) && !memcmp(&d[i].p, &disk[i].p, sizeof(point)) &&
+               !memcmp(d[i].data, hit[i].data, d[i].n*sizeof(float)) &&
+               !memcmp(d[i].data, disk[i].data, d[i].n*sizeof(float));
+    }
+    TEST(same);
+
+    // Different options must not hit the same entry.
+    harris_params q = p;
+    q.thresh = 5;
+    TEST(feature_cache_key(im, p) != feature_cache_key(im, q));
+    disable_feature_cache();
+    remove(fname);
+
+    free_descriptors(d, n);
+    free_descriptors(first, m);
+    free_descriptors(hit, k);
+    free_descriptors(disk, dn);
+    free_image(im);
+}
+
+void test_match_descriptors()
+{
+    float av[] = {0, 3, 3.1};
+    float bv[] = {2, 3.5};
+    descriptor a[3], b[2];
+    int i, n = 0;
+    for(i = 0; i < 3; ++i){ a[i].p = make_point(i, 0); a[i].n = 1; a[i].data = &av[i]; a[i].bits = 0; }
+    for(i = 0; i < 2; ++i){ b[i].p = make_point(i, 1); b[i].n = 1; b[i].data = &bv[i]; b[i].bits = 0; }
+
+    // a1 and a2 both want b1, only the closer one keeps it.
+    match *m = match_descriptors(a, 3, b, 2, &n);
+    TEST(n == 2);
+    TEST(m[0].ai == 2 && m[0].bi == 1 && within_eps(m[0].distance, .4, EPS));
+    TEST(m[1].ai == 0 && m[1].bi == 0);
+    free(m);
+
+    // b0 is closer to a1 than to a0, so a0-b0 isn't mutual.
+    m = match_descriptors_mutual(a, 3, b, 2, &n);
+    TEST(n == 1);
+    TEST(m[0].ai == 2 && m[0].bi == 1);
+    free(m);
+}
+
+void test_binary_descriptors()
+{
+    image im = load_image("data/Rainier1.png");
+    harris_params p = make_harris_params(2, 50, 3);
+    p.binary = 1;
+    int n = 0, mn = 0;
+    descriptor *d = detect_features(im, p, &n);
+    TEST(n > 0 && d[0].n == BRIEF_BITS && d[0].bits && !d[0].data);
+
+    // Every descriptor should find itself.
+    match *m = match_descriptors(d, n, d, n, &mn);
+    int i, exact = 1;
+    for(i = 0; i < mn; ++i) if(m[i].distance != 0) exact = 0;
+    TEST(mn > 0 && exact);
+    free(m);
+    free_descriptors(d, n);
+    free_image(im);
+}
 
 void test_projection()
 {
@@ -527,10 +1349,69 @@ void test_compute_homography()
     Hp.data[1][0] = -0.0487439; Hp.data[1][1] = -1.3077799; Hp.data[1][2] = 1.4796660;
     Hp.data[2][0] = -0.0788730; Hp.data[2][1] = -0.3727209; Hp.data[2][2] = 1.0000000;
     TEST(same_matrix(H, Hp));
+
+    // Overdetermined, noise-free system recovers the homography exactly.
+    match *many = calloc(12, sizeof(match));
+    int i;
+    for(i = 0; i < 12; ++i){
+        many[i].p = make_point(37*(i%4) + 3*i, 29*(i/4) - 2*i);
+        many[i].q = project_point(Hp, many[i].p);
+    }
+    matrix Hm = compute_homography(many, 12);
+    TEST(same_matrix(Hm, Hp));
+    free_matrix(Hm);
+    free(many);
     free_matrix(H);
     free_matrix(Hp);
 }
 
+void test_projection_remap()
+{
+    image im = load_image("data/dogsmall.jpg");
+    remap r1 = get_projection_remap(im.w, im.h, 200, CYLINDRICAL);
+    remap r2 = get_projection_remap(im.w, im.h, 200, CYLINDRICAL);
+    TEST(r1.x == r2.x);
+
+    // The optical center maps onto itself.
+    image c = cylindrical_project(im, 200);
+    int dx = (c.w - im.w)/2;
+    TEST(within_eps(get_pixel(c, im.w/2 + dx, im.h/2, 1), get_pixel(im, im.w/2, im.h/2, 1), EPS));
+    image s = spherical_project(im, 200);
+    TEST(within_eps(get_pixel(s, im.w/2, im.h/2, 1), get_pixel(im, im.w/2, im.h/2, 1), EPS));
+    clear_remap_cache();
+    free_image(im);
+    free_image(c);
+    free_image(s);
+}
+
+void test_tiled_combine()
+{
+    image a = load_image("data/Rainier1.png");
+    image b = load_image("data/Rainier2.png");
+    matrix H = make_translation_homography(-200, 15);
+    image full = combine_images(a, b, H);
+    TEST(combine_images_tiled(a, b, H, "test_tiles.bin", 64));
+
+    image t = load_image_tile("test_tiles.bin", 4, 2);
+    image crop = make_image(t.w, t.h, t.c);
+    int i, j, k;
+    for(k = 0; k < t.c; ++k){
+        for(j = 0; j < t.h; ++j){
+            for(i = 0; i < t.w; ++i){
+                set_pixel(crop, i, j, k, get_pixel(full, i + 4*64, j + 2*64, k));
+            }
+        }
+    }
+    TEST(same_image(t, crop, EPS));
+    remove("test_tiles.bin");
+    free_matrix(H);
+    free_image(a);
+    free_image(b);
+    free_image(full);
+    free_image(t);
+    free_image(crop);
+}
+
 void test_activate_matrix()
 {
     matrix a = load_matrix("data/test/a.matrix");
@@ -627,6 +1508,58 @@ void test_layer()
     TEST(same_matrix(updated_v, l.v));
 }
 
+void test_scratch()
+{
+    matrix a = random_matrix(6, 6, 1);
+    matrix inv = matrix_invert(a);
+    int fresh, reused, fresh1, reused1, i, j;
+
+    push_scratch_scope();
+    int same = 1;
+    for(i = 0; i < 4; ++i){
+        image im = make_image(64, 48, 3);
+        image tmp = make_image_uninit(64, 48, 3);
+        matrix m = make_matrix(10, 7);
+        matrix t = transpose_matrix(m);
+        matrix pinv = matrix_invert(a);
+        for(j = 0; j < 36; ++j) same &= pinv.data[j/6][j%6] == inv.data[j/6][j%6];
+        for(j = 0; j < 64*48*3; ++j) same &= im.data[j] == 0;
+        for(j = 0; j < 70; ++j) same &= m.data[j/7][j%7] == 0 && t.data[j%7][j/7] == 0;
+        // Dirty everything so the next round has to clear it again.
+        for(j = 0; j < 64*48*3; ++j) im.data[j] = tmp.data[j] = 1;
+        m.data[9][6] = t.data[6][9] = 1;
+        free_image(im);
+        free_image(tmp);
+        free_matrix(m);
+        free_matrix(t);
+        free_matrix(pinv);
+        if(i == 0) scratch_stats(&fresh1, &reused1);
+    }
+    scratch_stats(&fresh, &reused);
+    TEST(same);
+    // Only the first round should have gone to malloc.
+    TEST(fresh == fresh1 && reused > reused1);
+
+    // Buffers stay good after the scope is gone and free normally.
+    image keep = make_image(8, 8, 1);
+    matrix mkeep = make_matrix(3, 3);
+    pop_scratch_scope();
+    scratch_stats(&fresh, &reused);
+    keep.data[63] = 2;
+    mkeep.data[2][2] = 2;
+    TEST(keep.data[63] == 2 && mkeep.data[2][2] == 2);
+    free_image(keep);
+    free_matrix(mkeep);
+
+    // Outside a scope allocation is plain calloc.
+    image plain = make_image(64, 48, 3);
+    scratch_stats(&fresh1, &reused1);
+    TEST(fresh1 == fresh && reused1 == reused);
+    free_image(plain);
+    free_matrix(a);
+    free_matrix(inv);
+}
+
 void make_matrix_test()
 {
     srand(1);
@@ -704,9 +1637,14 @@ void test_hw0()
     test_copy();
     test_shift();
     test_clamp();
+    test_plane_ops();
     test_grayscale();
     test_rgb_to_hsv();
     test_hsv_to_rgb();
+    test_hcl_fast();
+    test_colorspace();
+    test_image_binary();
+    test_save_async();
     printf("%d tests, %d passed, %d failed\n", tests_total, tests_total-tests_fail, tests_fail);
 }
 void test_hw1()
@@ -716,6 +1654,8 @@ void test_hw1()
     test_bl_interpolate();
     test_bl_resize();
     test_multiple_resize();
+    test_resample_image();
+    test_integer_resize();
     printf("%d tests, %d passed, %d failed\n", tests_total, tests_total-tests_fail, tests_fail);
 }
 void test_hw2()
@@ -729,14 +1669,26 @@ void test_hw2()
     test_hybrid_image();
     test_frequency_image();
     test_sobel();
+    test_image_u8();
+    test_image_u8_layout();
     printf("%d tests, %d passed, %d failed\n", tests_total, tests_total-tests_fail, tests_fail);
 }
 void test_hw3()
 {
     test_structure();
     test_cornerness();
+    test_nms();
+    test_harris_keypoints();
+    test_select_keypoints();
+    test_multiscale_features();
+    test_oriented_descriptors();
+    test_feature_cache();
+    test_match_descriptors();
+    test_binary_descriptors();
     test_projection();
     test_compute_homography();
+    test_projection_remap();
+    test_tiled_combine();
     printf("%d tests, %d passed, %d failed\n", tests_total, tests_total-tests_fail, tests_fail);
 }
 void make_hw4_tests()
@@ -825,6 +1777,7 @@ void test_hw5()
     test_activate_matrix();
     test_gradient_matrix();
     test_layer();
+    test_scratch();
     printf("%d tests, %d passed, %d failed\n", tests_total, tests_total-tests_fail, tests_fail);
 }
 
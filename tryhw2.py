@@ -6,8 +6,11 @@ f = make_box_filter(7)
 blur = convolve_image(im, f, 1)
 thumb = nn_resize(blur, blur.w//7, blur.h//7)
 thumb_nn = nn_resize(im, im.w//7, im.h//7)
+# Same thumbnail in one pass, averaging each 7x7 block directly.
+thumb_area = area_resize(im, im.w//7, im.h//7)
 save_image(thumb, "output/dogthumb")
 save_image(thumb_nn, "output/dogthumb_nn")
+save_image(thumb_area, "output/dogthumb_area")
 save_image(blur, "output/dog-blur")
 
 # 2. higpass filter
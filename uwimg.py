@@ -20,14 +20,33 @@ class IMAGE(Structure):
     def __sub__(self, other):
         return sub_image(self, other)
 
+class IMAGE_U8(Structure):
+    _fields_ = [("w", c_int),
+                ("h", c_int),
+                ("c", c_int),
+                ("data", POINTER(c_ubyte)),
+                ("layout", c_int)]
+
 class POINT(Structure):
     _fields_ = [("x", c_float),
                 ("y", c_float)]
 
+class HARRIS_PARAMS(Structure):
+    _fields_ = [("sigma", c_float),
+                ("thresh", c_float),
+                ("nms", c_int),
+                ("max_corners", c_int),
+                ("grid", c_int),
+                ("binary", c_int),
+                ("subpixel", c_int),
+                ("octaves", c_int),
+                ("oriented", c_int)]
+
 class DESCRIPTOR(Structure):
     _fields_ = [("p", POINT),
                 ("n", c_int),
-                ("data", POINTER(c_float))]
+                ("data", POINTER(c_float)),
+                ("bits", POINTER(c_ulonglong))]
 
 class MATRIX(Structure):
     _fields_ = [("rows", c_int),
@@ -118,6 +137,20 @@ hcl_to_rgb = lib.hcl_to_rgb
 hcl_to_rgb.argtypes = [IMAGE]
 hcl_to_rgb.restype = None
 
+COLOR_RGB, COLOR_LINEAR_RGB, COLOR_XYZ, COLOR_LAB, COLOR_YCBCR, COLOR_GRAY = range(6)
+
+convert_colorspace = lib.convert_colorspace
+convert_colorspace.argtypes = [IMAGE, c_int, c_int]
+convert_colorspace.restype = IMAGE
+
+rgb_to_hcl_fast = lib.rgb_to_hcl_fast
+rgb_to_hcl_fast.argtypes = [IMAGE]
+rgb_to_hcl_fast.restype = None
+
+hcl_to_rgb_fast = lib.hcl_to_rgb_fast
+hcl_to_rgb_fast.argtypes = [IMAGE]
+hcl_to_rgb_fast.restype = None
+
 load_image_lib = lib.load_image
 load_image_lib.argtypes = [c_char_p]
 load_image_lib.restype = IMAGE
@@ -139,10 +172,89 @@ save_image_lib.restype = None
 def save_image(im, f):
     return save_image_lib(im, f.encode('ascii'))
 
+save_image_async_lib = lib.save_image_async
+save_image_async_lib.argtypes = [IMAGE, c_char_p, c_int]
+save_image_async_lib.restype = c_void_p
+
+# The image belongs to the writer afterwards, don't use it again.
+def save_image_async(im, f, png=False):
+    return save_image_async_lib(im, f.encode('ascii'), 1 if png else 0)
+
+wait_save = lib.wait_save
+wait_save.argtypes = [c_void_p]
+wait_save.restype = c_int
+
+detach_save = lib.detach_save
+detach_save.argtypes = [c_void_p]
+detach_save.restype = None
+
+wait_all_saves = lib.wait_all_saves
+wait_all_saves.argtypes = []
+wait_all_saves.restype = None
+
+push_scratch_scope = lib.push_scratch_scope
+push_scratch_scope.argtypes = []
+push_scratch_scope.restype = None
+
+pop_scratch_scope = lib.pop_scratch_scope
+pop_scratch_scope.argtypes = []
+pop_scratch_scope.restype = None
+
 same_image = lib.same_image
 same_image.argtypes = [IMAGE, IMAGE]
 same_image.restype = c_int
 
+LAYOUT_PLANAR, LAYOUT_INTERLEAVED = range(2)
+
+convert_layout_u8 = lib.convert_layout_u8
+convert_layout_u8.argtypes = [IMAGE_U8, c_int]
+convert_layout_u8.restype = IMAGE_U8
+
+load_image_u8_lib = lib.load_image_u8
+load_image_u8_lib.argtypes = [c_char_p]
+load_image_u8_lib.restype = IMAGE_U8
+
+def load_image_u8(f):
+    return load_image_u8_lib(f.encode('ascii'))
+
+save_image_u8_lib = lib.save_image_u8
+save_image_u8_lib.argtypes = [IMAGE_U8, c_char_p]
+save_image_u8_lib.restype = None
+
+def save_image_u8(im, f):
+    return save_image_u8_lib(im, f.encode('ascii'))
+
+save_png_u8_lib = lib.save_png_u8
+save_png_u8_lib.argtypes = [IMAGE_U8, c_char_p]
+save_png_u8_lib.restype = None
+
+def save_png_u8(im, f):
+    return save_png_u8_lib(im, f.encode('ascii'))
+
+free_image_u8 = lib.free_image_u8
+free_image_u8.argtypes = [IMAGE_U8]
+free_image_u8.restype = None
+
+u8_to_image = lib.u8_to_image
+u8_to_image.argtypes = [IMAGE_U8]
+u8_to_image.restype = IMAGE
+
+image_to_u8 = lib.image_to_u8
+image_to_u8.argtypes = [IMAGE]
+image_to_u8.restype = IMAGE_U8
+
+rgb_to_grayscale_u8 = lib.rgb_to_grayscale_u8
+rgb_to_grayscale_u8.argtypes = [IMAGE_U8]
+rgb_to_grayscale_u8.restype = IMAGE_U8
+
+box_filter_u8 = lib.box_filter_u8
+box_filter_u8.argtypes = [IMAGE_U8, c_int]
+box_filter_u8.restype = IMAGE_U8
+
+convolve_image_u8 = lib.convolve_image_u8
+convolve_image_u8.argtypes = [IMAGE_U8, IMAGE, c_int]
+convolve_image_u8.restype = IMAGE_U8
+
 nn_resize = lib.nn_resize
 nn_resize.argtypes = [IMAGE, c_int, c_int]
 nn_resize.restype = IMAGE
@@ -151,6 +263,19 @@ bilinear_resize = lib.bilinear_resize
 bilinear_resize.argtypes = [IMAGE, c_int, c_int]
 bilinear_resize.restype = IMAGE
 
+RESAMPLE_NEAREST, RESAMPLE_BILINEAR, RESAMPLE_BICUBIC, RESAMPLE_LANCZOS, RESAMPLE_AREA = range(5)
+
+resample_image = lib.resample_image
+resample_image.argtypes = [IMAGE, c_int, c_int, c_int]
+resample_image.restype = IMAGE
+
+resample_image_u8 = lib.resample_image_u8
+resample_image_u8.argtypes = [IMAGE_U8, c_int, c_int, c_int]
+resample_image_u8.restype = IMAGE_U8
+
+def area_resize(im, w, h):
+    return resample_image(im, w, h, RESAMPLE_AREA)
+
 make_sharpen_filter = lib.make_sharpen_filter
 make_sharpen_filter.argtypes = []
 make_sharpen_filter.restype = IMAGE
@@ -207,10 +332,14 @@ cylindrical_project = lib.cylindrical_project
 cylindrical_project.argtypes = [IMAGE, c_float]
 cylindrical_project.restype = IMAGE
 
-spherical_project = lib.cylindrical_project
+spherical_project = lib.spherical_project
 spherical_project.argtypes = [IMAGE, c_float]
 spherical_project.restype = IMAGE
 
+clear_remap_cache = lib.clear_remap_cache
+clear_remap_cache.argtypes = []
+clear_remap_cache.restype = None
+
 structure_matrix = lib.structure_matrix
 structure_matrix.argtypes = [IMAGE, c_float]
 structure_matrix.restype = IMAGE
@@ -239,8 +368,33 @@ optical_flow_webcam = lib.optical_flow_webcam
 optical_flow_webcam.argtypes = [c_int, c_int, c_int]
 optical_flow_webcam.restype = None
 
-def panorama_image(a, b, sigma=2, thresh=5, nms=3, inlier_thresh=2, iters=10000, cutoff=30):
-    return panorama_image_lib(a, b, sigma, thresh, nms, inlier_thresh, iters, cutoff)
+make_harris_params = lib.make_harris_params
+make_harris_params.argtypes = [c_float, c_float, c_int]
+make_harris_params.restype = HARRIS_PARAMS
+
+panorama_image_params = lib.panorama_image_params
+panorama_image_params.argtypes = [IMAGE, IMAGE, HARRIS_PARAMS, c_float, c_int, c_int]
+panorama_image_params.restype = IMAGE
+
+enable_feature_cache_lib = lib.enable_feature_cache
+enable_feature_cache_lib.argtypes = [c_char_p]
+enable_feature_cache_lib.restype = None
+
+def enable_feature_cache(d=None):
+    enable_feature_cache_lib(d.encode('ascii') if d else None)
+
+disable_feature_cache = lib.disable_feature_cache
+disable_feature_cache.argtypes = []
+disable_feature_cache.restype = None
+
+def panorama_image(a, b, sigma=2, thresh=5, nms=3, inlier_thresh=2, iters=10000, cutoff=30, max_corners=0, grid=0, binary=0, octaves=0, oriented=0):
+    p = make_harris_params(sigma, thresh, nms)
+    p.max_corners = max_corners
+    p.grid = grid
+    p.binary = binary
+    p.octaves = octaves
+    p.oriented = oriented
+    return panorama_image_params(a, b, p, inlier_thresh, iters, cutoff)
 
 
 train_model = lib.train_model